@@ -3,50 +3,175 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include "BibakBOXProtocol.h"
+#include "BibakBOXDelta.h"
+#include "BibakBOXManifest.h"
 
 #define BUFFER_SIZE 1024
+#define FILE_CHUNK_SIZE 65536           // upload contents sent per send call
+#define MAX_STATUS_PAYLOAD (64 << 20)   // largest answer accepted, e.g. a long file listing
+#define LITERAL_CHUNK 65536             // literal bytes per delta instruction
+#define DEBOUNCE_MS 100                 // a changed file is sent once it has been quiet this long
+#define MAX_DELAY_MS 2000               // or after this long, if it keeps changing
+#define CHANGE_BUCKETS 4096
+#define EVENT_BUFFER_SIZE 65536
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
 
 char* serverIP;
 int serverPort;
 char* clientDir;
+int serverSocket;
+int inotifyFd;
+int stopEvent;                  // signalled to stop the watcher thread
+char** watchPaths = NULL;       // directory of each watch descriptor, relative to clientDir
+int watchCapacity = 0;
 
-// Function to synchronize directory contents with the server
-void synchronizeDirectory(int serverSocket) 
+// A request sent to the server and not answered yet. The server answers in request
+// order, so the receiver thread matches each status frame to the oldest entry.
+typedef struct PendingRequest 
 {
-    char buffer[BUFFER_SIZE];
+    uint32_t requestId;
+    uint8_t type;
+    char name[BUFFER_SIZE];
+    int waited;                 // a thread waits for the answer and frees the entry
+    int done;
+    uint32_t status;
+    unsigned char* result;      // status payload after the code
+    size_t resultLength;
+    struct PendingRequest* next;
+} PendingRequest;
 
-    DIR* dir = opendir(clientDir);
-    if (dir == NULL) {
-        perror("Error opening directory");
-        return;
+pthread_mutex_t sendMutex = PTHREAD_MUTEX_INITIALIZER;     // one frame at a time on the socket
+pthread_mutex_t pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t answered = PTHREAD_COND_INITIALIZER;
+PendingRequest* pendingHead = NULL;
+PendingRequest* pendingTail = NULL;
+uint32_t nextRequestId = 1;
+
+const char* requestName(uint8_t type) 
+{
+    switch (type) 
+	{
+        case FRAME_HELLO: return "hello";
+        case FRAME_UPLOAD: return "upload";
+        case FRAME_DELETE: return "delete";
+        case FRAME_CHECK: return "check";
+        case FRAME_SIGNATURE: return "get the signature of";
+        case FRAME_DELTA: return "update";
+        case FRAME_MANIFEST: return "compare";
+        case FRAME_DOWNLOAD: return "send";
     }
+    return "request";
+}
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL)
+// Function to record a request about to be sent; called with sendMutex held, so
+// requests are queued in the order they go out
+PendingRequest* addPending(uint8_t type, const char* name, int waited) 
+{
+    PendingRequest* request = calloc(1, sizeof(PendingRequest));
+    request->requestId = nextRequestId++;
+    request->type = type;
+    request->waited = waited;
+    snprintf(request->name, sizeof(request->name), "%s", name);
+
+    pthread_mutex_lock(&pendingMutex);
+    if (pendingTail == NULL) 
 	{
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
-		{
-            strcpy(buffer, entry->d_name);
-            send(serverSocket, buffer, strlen(buffer), 0);
-            memset(buffer, 0, sizeof(buffer));
-        }
+        pendingHead = request;
     }
+	else 
+	{
+        pendingTail->next = request;
+    }
+    pendingTail = request;
+    pthread_mutex_unlock(&pendingMutex);
+    return request;
+}
 
-    closedir(dir);
+// Function to send a request whose payload is in memory; name is what it is about. With
+// waited set the caller gets the entry back to wait on; otherwise failures are reported
+// when the answer comes.
+PendingRequest* sendData(uint8_t type, const char* name, const void* payload, size_t length, int waited) 
+{
+    pthread_mutex_lock(&sendMutex);
+    PendingRequest* request = addPending(type, name, waited);
+    if (sendFrame(serverSocket, type, request->requestId, payload, length) == -1) 
+	{
+        perror("Error sending request");
+    }
+    pthread_mutex_unlock(&sendMutex);
+    return waited ? request : NULL;
 }
 
-// Function to send file to the server
-void sendFile(int serverSocket, const char* filePath) 
+// Function to send a request whose payload is a file name
+PendingRequest* sendRequest(uint8_t type, const char* name, int waited) 
 {
-    char buffer[BUFFER_SIZE];
+    return sendData(type, name, name, strlen(name), waited);
+}
+
+// Function to wait for the answer to a request sent with waited set
+void waitForAnswer(PendingRequest* request) 
+{
+    pthread_mutex_lock(&pendingMutex);
+    while (!request->done) 
+	{
+        pthread_cond_wait(&answered, &pendingMutex);
+    }
+    pthread_mutex_unlock(&pendingMutex);
+}
+
+void freeRequest(PendingRequest* request) 
+{
+    free(request->result);
+    free(request);
+}
 
+// Function to send the contents of a file that make up the rest of a frame. The frame
+// length is fixed up front: a file that shrinks while it is sent is padded with zeros,
+// and anything it grows by waits for the next synchronization.
+int sendContents(FILE* file, uint64_t size) 
+{
+    char buffer[FILE_CHUNK_SIZE];
+
+    while (size > 0) 
+	{
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        size_t bytesRead = fread(buffer, 1, chunk, file);
+        if (bytesRead < chunk) 
+		{
+            if (ferror(file)) 
+			{
+                perror("Error reading from file");
+            }
+            memset(buffer + bytesRead, 0, chunk - bytesRead);
+        }
+        if (sendAll(serverSocket, buffer, chunk) == -1) 
+		{
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function to send file to the server. The upload is one frame holding the name and
+// the contents; it is not waited for, so uploads stream back to back.
+void sendFile(const char* filePath, const char* name) 
+{
     FILE* file = fopen(filePath, "rb");
     if (file == NULL) 
 	{
@@ -54,114 +179,969 @@ void sendFile(int serverSocket, const char* filePath)
         return;
     }
 
-    send(serverSocket, "upload:", strlen("upload:"), 0);
-    send(serverSocket, filePath, strlen(filePath), 0);
+    struct stat fileStat;
+    size_t nameLength = strlen(name);
+    if (fstat(fileno(file), &fileStat) == -1 || nameLength > MAX_NAME_LENGTH) 
+	{
+        fprintf(stderr, "Cannot upload %s\n", filePath);
+        fclose(file);
+        return;
+    }
+
+    uint64_t size = fileStat.st_size;
+    unsigned char header[FRAME_HEADER_SIZE + 2];
+
+    pthread_mutex_lock(&sendMutex);
+    PendingRequest* request = addPending(FRAME_UPLOAD, name, 0);
+    encodeFrameHeader(header, FRAME_UPLOAD, request->requestId, 2 + nameLength + size);
+    putUint16(header + FRAME_HEADER_SIZE, nameLength);
+    if (sendAll(serverSocket, header, sizeof(header)) == -1 || sendAll(serverSocket, name, nameLength) == -1 ||
+        sendContents(file, size) == -1) 
+	{
+        perror("Error sending file");
+    }
+    pthread_mutex_unlock(&sendMutex);
+
+    fclose(file);
+}
+
+// Signature of the server's copy of a file, with its blocks chained by weak checksum
+typedef struct 
+{
+    const unsigned char* entries;
+    uint32_t count;
+    uint32_t blockSize;
+    int32_t* buckets;       // first block whose checksum hashes here, -1 if none
+    int32_t* chain;         // next block in the same bucket
+    int bucketBits;
+} BlockIndex;
+
+uint32_t bucketOf(const BlockIndex* index, uint32_t weak) 
+{
+    return (uint32_t)(weak * 2654435761u) >> (32 - index->bucketBits);
+}
+
+// Function to index a signature sent by the server; returns 0 if it is malformed
+int buildIndex(BlockIndex* index, const unsigned char* signature, size_t length) 
+{
+    if (length < 4 || (length - 4) % SIGNATURE_ENTRY_SIZE != 0) 
+	{
+        return 0;
+    }
+    index->blockSize = getUint32(signature);
+    index->entries = signature + 4;
+    index->count = (length - 4) / SIGNATURE_ENTRY_SIZE;
+    if (index->blockSize < MIN_BLOCK_SIZE || index->blockSize > MAX_BLOCK_SIZE) 
+	{
+        return 0;
+    }
+
+    index->bucketBits = 4;
+    while ((1u << index->bucketBits) < 2 * index->count) 
+	{
+        index->bucketBits++;
+    }
+    index->buckets = malloc(sizeof(int32_t) << index->bucketBits);
+    index->chain = malloc(sizeof(int32_t) * (index->count ? index->count : 1));
+    memset(index->buckets, 0xff, sizeof(int32_t) << index->bucketBits);
+
+    // Chained back to front, so the lowest of identical blocks is found first
+    for (int32_t block = index->count - 1; block >= 0; block--) 
+	{
+        uint32_t bucket = bucketOf(index, getUint32(index->entries + (size_t)block * SIGNATURE_ENTRY_SIZE));
+        index->chain[block] = index->buckets[bucket];
+        index->buckets[bucket] = block;
+    }
+    return 1;
+}
+
+// Function to find a block of the server's copy equal to the data; the strong hash is
+// only computed once a weak checksum matches
+int32_t findBlock(const BlockIndex* index, uint32_t weak, const unsigned char* data) 
+{
+    unsigned char strong[STRONG_HASH_SIZE];
+    int hashed = 0;
+
+    for (int32_t block = index->buckets[bucketOf(index, weak)]; block != -1; block = index->chain[block]) 
+	{
+        const unsigned char* entry = index->entries + (size_t)block * SIGNATURE_ENTRY_SIZE;
+        if (getUint32(entry) != weak) 
+		{
+            continue;
+        }
+        if (!hashed) 
+		{
+            Md5Context context;
+            md5Init(&context);
+            md5Update(&context, data, index->blockSize);
+            md5Final(&context, strong);
+            hashed = 1;
+        }
+        if (memcmp(strong, entry + 4, STRONG_HASH_SIZE) == 0) 
+		{
+            return block;
+        }
+    }
+    return -1;
+}
+
+void writeCopy(FILE* delta, uint32_t first, uint32_t count) 
+{
+    unsigned char op[9] = { DELTA_COPY };
+    if (count > 0) 
+	{
+        putUint32(op + 1, first);
+        putUint32(op + 5, count);
+        fwrite(op, 1, sizeof(op), delta);
+    }
+}
+
+void writeLiteral(FILE* delta, const unsigned char* data, size_t length) 
+{
+    unsigned char op[5] = { DELTA_LITERAL };
+    if (length > 0) 
+	{
+        putUint32(op + 1, length);
+        fwrite(op, 1, sizeof(op), delta);
+        fwrite(data, 1, length, delta);
+    }
+}
+
+// Function to write the delta instructions that turn the server's copy into the file.
+// A block-sized window slides over the file a byte at a time with a rolling checksum;
+// wherever it lines up with a block the server has, a reference replaces the data.
+// Returns 0 on a read or write error.
+int writeDelta(FILE* file, FILE* delta, const BlockIndex* index, uint64_t* size, unsigned char* digest) 
+{
+    size_t blockSize = index->blockSize;
+    size_t capacity = LITERAL_CHUNK + 2 * blockSize;
+    unsigned char* window = malloc(capacity);
+    size_t literal = 0;         // first byte not sent yet
+    size_t position = 0;        // start of the block being matched
+    size_t end = 0;
+    int atEnd = 0;
+    int failed = 0;
+    int rolling = 0;            // weak holds the checksum of the block at position
+    uint32_t weak = 0;
+    uint32_t runFirst = 0;      // blocks matched back to back go out as one copy
+    uint32_t runCount = 0;
+
+    Md5Context context;
+    md5Init(&context);
+    *size = 0;
 
     while (1) 
 	{
-        size_t bytesRead = fread(buffer, 1, sizeof(buffer), file);
-        if (bytesRead > 0) 
+        if (end - position < blockSize && !atEnd) 
 		{
-            send(serverSocket, buffer, bytesRead, 0);
+            // Keep a whole block ahead, moving the bytes not sent yet to the front
+            memmove(window, window + literal, end - literal);
+            position -= literal;
+            end -= literal;
+            literal = 0;
+
+            size_t bytesRead = fread(window + end, 1, capacity - end, file);
+            md5Update(&context, window + end, bytesRead);
+            *size += bytesRead;
+            end += bytesRead;
+            if (bytesRead == 0) 
+			{
+                failed = ferror(file);
+                atEnd = 1;
+            }
+            continue;
+        }
+        if (end - position < blockSize) 
+		{
+            break;
         }
 
-        if (bytesRead < sizeof(buffer)) 
+        if (!rolling) 
 		{
-            if (feof(file)) {
-                break;
-            } else if (ferror(file)) {
-                perror("Error reading from file");
-                break;
+            weak = weakChecksum(window + position, blockSize);
+            rolling = 1;
+        }
+        int32_t block = findBlock(index, weak, window + position);
+        if (block >= 0) 
+		{
+            writeLiteral(delta, window + literal, position - literal);
+            if (runCount > 0 && (uint32_t)block == runFirst + runCount) 
+			{
+                runCount++;
+            }
+			else 
+			{
+                writeCopy(delta, runFirst, runCount);
+                runFirst = block;
+                runCount = 1;
+            }
+            position += blockSize;
+            literal = position;
+            rolling = 0;
+            continue;
+        }
+
+        // No block starts here, so this byte is sent as it is
+        writeCopy(delta, runFirst, runCount);
+        runCount = 0;
+        if (position + 1 - literal >= LITERAL_CHUNK) 
+		{
+            writeLiteral(delta, window + literal, position + 1 - literal);
+            literal = position + 1;
+        }
+        if (position + blockSize < end) 
+		{
+            weak = rollChecksum(weak, blockSize, window[position], window[position + blockSize]);
+        }
+		else 
+		{
+            rolling = 0;
+        }
+        position++;
+    }
+
+    // The tail shorter than a block is always literal
+    writeCopy(delta, runFirst, runCount);
+    writeLiteral(delta, window + literal, end - literal);
+    md5Final(&context, digest);
+    free(window);
+    return !failed && fflush(delta) == 0 && !ferror(delta);
+}
+
+// Function to spool the delta from the server's signature to a temporary file; returns
+// it rewound, or NULL if no delta can be made
+FILE* makeDelta(const char* filePath, const unsigned char* signature, size_t length, uint64_t* size,
+                unsigned char* digest) 
+{
+    BlockIndex index;
+    if (!buildIndex(&index, signature, length)) 
+	{
+        fprintf(stderr, "Bad signature for %s\n", filePath);
+        return NULL;
+    }
+
+    FILE* file = fopen(filePath, "rb");
+    FILE* delta = file != NULL ? tmpfile() : NULL;
+    if (delta == NULL) 
+	{
+        perror(file == NULL ? "Error opening file" : "Error creating temporary file");
+    }
+	else if (!writeDelta(file, delta, &index, size, digest)) 
+	{
+        perror("Error computing delta");
+        fclose(delta);
+        delta = NULL;
+    }
+
+    if (file != NULL) 
+	{
+        fclose(file);
+    }
+    free(index.buckets);
+    free(index.chain);
+    return delta;
+}
+
+// Function to update a file the server already holds. The server sends the signature of
+// its copy and only the changes go back. The whole file is sent instead when the delta
+// would be no smaller, or when the server cannot rebuild the file from it.
+void sendDelta(const char* filePath, const char* name) 
+{
+    size_t nameLength = strlen(name);
+    if (nameLength > MAX_NAME_LENGTH) 
+	{
+        sendFile(filePath, name);
+        return;
+    }
+
+    PendingRequest* signature = sendRequest(FRAME_SIGNATURE, name, 1);
+    waitForAnswer(signature);
+
+    uint64_t size = 0;
+    uint32_t blockSize = signature->resultLength >= 4 ? getUint32(signature->result) : 0;
+    unsigned char digest[STRONG_HASH_SIZE];
+    FILE* delta = NULL;
+    if (signature->status == STATUS_OK) 
+	{
+        delta = makeDelta(filePath, signature->result, signature->resultLength, &size, digest);
+    }
+    freeRequest(signature);
+
+    uint64_t payloadLength = 0;
+    if (delta != NULL) 
+	{
+        payloadLength = 2 + nameLength + DELTA_HEADER_SIZE + (uint64_t)ftello(delta);
+        rewind(delta);
+    }
+    if (delta == NULL || payloadLength >= size) 
+	{
+        if (delta != NULL) 
+		{
+            fclose(delta);
+        }
+        sendFile(filePath, name);
+        return;
+    }
+
+    unsigned char header[FRAME_HEADER_SIZE + 2];
+    unsigned char parameters[DELTA_HEADER_SIZE];
+    putUint32(parameters, blockSize);
+    putUint64(parameters + 4, size);
+    memcpy(parameters + 12, digest, STRONG_HASH_SIZE);
+
+    pthread_mutex_lock(&sendMutex);
+    PendingRequest* request = addPending(FRAME_DELTA, name, 1);
+    encodeFrameHeader(header, FRAME_DELTA, request->requestId, payloadLength);
+    putUint16(header + FRAME_HEADER_SIZE, nameLength);
+    if (sendAll(serverSocket, header, sizeof(header)) == -1 || sendAll(serverSocket, name, nameLength) == -1 ||
+        sendAll(serverSocket, parameters, sizeof(parameters)) == -1 ||
+        sendContents(delta, payloadLength - 2 - nameLength - DELTA_HEADER_SIZE) == -1) 
+	{
+        perror("Error sending delta");
+    }
+    pthread_mutex_unlock(&sendMutex);
+    fclose(delta);
+
+    waitForAnswer(request);
+    if (request->status == STATUS_OK) 
+	{
+        printf("Updated %s: sent %llu of %llu bytes (%.1f%% saved)\n", name, (unsigned long long)payloadLength,
+               (unsigned long long)size, 100.0 * (size - payloadLength) / size);
+    }
+	else 
+	{
+        fprintf(stderr, "Server could not update %s from a delta (%s), sending the whole file\n", name,
+                statusName(request->status));
+        sendFile(filePath, name);
+    }
+    freeRequest(request);
+}
+
+// A file written from the server's copy. Its events must not send it straight back, so
+// the watcher skips it while it still looks the way it was written.
+typedef struct Download 
+{
+    char name[BUFFER_SIZE];
+    off_t size;
+    struct timespec mtime;
+    struct Download* next;
+} Download;
+
+pthread_mutex_t downloadMutex = PTHREAD_MUTEX_INITIALIZER;
+Download* downloads = NULL;
+
+void recordDownload(const char* name, const struct stat* fileStat) 
+{
+    Download* download = calloc(1, sizeof(Download));
+    snprintf(download->name, sizeof(download->name), "%s", name);
+    download->size = fileStat->st_size;
+    download->mtime = fileStat->st_mtim;
+
+    pthread_mutex_lock(&downloadMutex);
+    download->next = downloads;
+    downloads = download;
+    pthread_mutex_unlock(&downloadMutex);
+}
+
+// Function to check whether a file is still as it was downloaded; a record that no
+// longer matches is dropped
+int isDownloaded(const char* name, const struct stat* fileStat) 
+{
+    int unchanged = 0;
+    pthread_mutex_lock(&downloadMutex);
+    for (Download** link = &downloads; *link != NULL; link = &(*link)->next) 
+	{
+        Download* download = *link;
+        if (strcmp(download->name, name) == 0) 
+		{
+            unchanged = download->size == fileStat->st_size &&
+                        download->mtime.tv_sec == fileStat->st_mtim.tv_sec &&
+                        download->mtime.tv_nsec == fileStat->st_mtim.tv_nsec;
+            if (!unchanged) 
+			{
+                *link = download->next;
+                free(download);
             }
+            break;
         }
     }
+    pthread_mutex_unlock(&downloadMutex);
+    return unchanged;
+}
 
-    fclose(file);
+// Function to create the directories above a file in the client directory
+void makeParents(const char* filePath) 
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", filePath);
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) 
+	{
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
 }
 
-// Function to handle directory synchronization
-void* synchronize(void* arg) 
+// Function to receive the contents of a downloaded file. They go to a temporary file
+// that replaces the real one once complete. Returns -1 if the connection failed.
+int receiveDownload(PendingRequest* request, uint64_t size) 
 {
-    int serverSocket = *((int*)arg);
-    char buffer[BUFFER_SIZE];
+    char buffer[FILE_CHUNK_SIZE];
+    char filePath[PATH_MAX];
+    char tempPath[PATH_MAX];
+    const char* slash = strrchr(request->name, '/');
+    snprintf(filePath, sizeof(filePath), "%s/%s", clientDir, request->name);
+    snprintf(tempPath, sizeof(tempPath), "%s/%.*s.bibakbox-%s", clientDir,
+             slash != NULL ? (int)(slash - request->name + 1) : 0, request->name,
+             slash != NULL ? slash + 1 : request->name);
+    makeParents(filePath);
 
-    // Send client directory name to the server
-    send(serverSocket, clientDir, strlen(clientDir), 0);
+    FILE* file = fopen(tempPath, "wb");
+    if (file == NULL) 
+	{
+        perror("Error creating file");
+    }
 
-    // Synchronize directory with server
-    synchronizeDirectory(serverSocket);
+    while (size > 0) 
+	{
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        if (recvAll(serverSocket, buffer, chunk) == -1) 
+		{
+            if (file != NULL) 
+			{
+                fclose(file);
+                unlink(tempPath);
+            }
+            return -1;
+        }
+        if (file != NULL && fwrite(buffer, 1, chunk, file) != chunk) 
+		{
+            perror("Error writing file");
+            fclose(file);
+            unlink(tempPath);
+            file = NULL;
+        }
+        size -= chunk;
+    }
 
-    while (1) 
+    struct stat fileStat;
+    if (file == NULL || fclose(file) != 0 || stat(tempPath, &fileStat) == -1) 
+	{
+        request->status = STATUS_ERROR;
+        unlink(tempPath);
+        return 0;
+    }
+    recordDownload(request->name, &fileStat);
+    if (rename(tempPath, filePath) == -1) 
+	{
+        perror("Error storing file");
+        request->status = STATUS_ERROR;
+        unlink(tempPath);
+        return 0;
+    }
+    printf("File downloaded: %s\n", request->name);
+    return 0;
+}
+
+// Function to read the server's status frames and hand each to its request
+void* receiveAnswers(void* arg) 
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    while (recvAll(serverSocket, header, sizeof(header)) == 0) 
 	{
-        // Monitor local directory for changes
-        DIR* dir = opendir(clientDir);
-        if (dir == NULL) 
+        FrameHeader frame;
+        decodeFrameHeader(header, &frame);
+
+        pthread_mutex_lock(&pendingMutex);
+        PendingRequest* request = pendingHead;
+        pthread_mutex_unlock(&pendingMutex);
+
+        // Downloads are written to disk as they arrive; other answers are buffered
+        int download = request != NULL && request->type == FRAME_DOWNLOAD;
+        if (frame.version != PROTOCOL_VERSION || frame.type != FRAME_STATUS || frame.length < 4 ||
+            (frame.length > MAX_STATUS_PAYLOAD && !download) || request == NULL ||
+            frame.requestId != request->requestId) 
 		{
-            perror("Error opening directory");
+            fprintf(stderr, "Unexpected frame from server\n");
             break;
         }
 
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) 
+        unsigned char* payload = malloc(download ? 4 : frame.length);
+        if (recvAll(serverSocket, payload, download ? 4 : frame.length) == -1) 
 		{
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                char filePath[BUFFER_SIZE];
-                sprintf(filePath, "%s/%s", clientDir, entry->d_name);
+            free(payload);
+            break;
+        }
+        request->status = getUint32(payload);
+        request->resultLength = download ? 0 : frame.length - 4;
+        memmove(payload, payload + 4, request->resultLength);
+        // A download that failed carries no contents; the local file is left alone
+        if (download && request->status == STATUS_OK && receiveDownload(request, frame.length - 4) == -1) 
+		{
+            free(payload);
+            break;
+        }
 
-                // Check if the file exists on the server
-                send(serverSocket, "check:", strlen("check:"), 0);
-                send(serverSocket, entry->d_name, strlen(entry->d_name), 0);
+        pthread_mutex_lock(&pendingMutex);
+        pendingHead = request->next;
+        if (pendingHead == NULL) 
+		{
+            pendingTail = NULL;
+        }
+        request->result = payload;
+        request->done = 1;
+        int waited = request->waited;  // a waiting thread may free the entry once unlocked
+        pthread_cond_broadcast(&answered);
+        pthread_mutex_unlock(&pendingMutex);
 
-                ssize_t numBytes = recv(serverSocket, buffer, sizeof(buffer), 0);
-                if (numBytes <= 0) 
-				{
-                    perror("Error receiving data from server");
-                    break;
-                }
+        if (!waited) 
+		{
+            if (request->status != STATUS_OK) 
+			{
+                fprintf(stderr, "Server could not %s %s: %s\n", requestName(request->type), request->name,
+                        statusName(request->status));
+            }
+            freeRequest(request);
+        }
+    }
 
-                buffer[numBytes] = '\0';
+    printf("\nConnection to server lost\n");
+    exit(EXIT_FAILURE);
+}
 
-                if (strcmp(buffer, "exists") != 0) 
-				{
-                    // File doesn't exist on the server, so send it
-                    sendFile(serverSocket, filePath);
-                } 
-				else 
-				{
-                    // File exists on the server, check if it's up to date
-                    send(serverSocket, "timestamp:", strlen("timestamp:"), 0);
-                    send(serverSocket, entry->d_name, strlen(entry->d_name), 0);
+// Names of files found by a scan, relative to the client directory
+typedef struct 
+{
+    char (*names)[BUFFER_SIZE];
+    int count;
+    int capacity;
+} NameList;
 
-                    numBytes = recv(serverSocket, buffer, sizeof(buffer), 0);
-                    if (numBytes <= 0) 
-					{
-                        perror("Error receiving data from server");
-                        break;
-                    }
+// A file that changed and has not been sent yet. Events for the same name are merged,
+// and the file goes out once it has been quiet for a while.
+typedef struct Change 
+{
+    char name[BUFFER_SIZE];
+    int created;                // first seen being created: if it is gone again, the server never had it
+    long firstSeen;
+    long lastSeen;
+    struct Change* next;        // pending changes, oldest first
+    struct Change* chain;       // same bucket of the name lookup
+} Change;
 
-                    buffer[numBytes] = '\0';
+Change* changeBuckets[CHANGE_BUCKETS];
+Change* changesHead = NULL;
+Change* changesTail = NULL;
 
-                    long clientTimestamp = strtol(buffer, NULL, 10);
-                    struct stat fileStat;
-                    stat(filePath, &fileStat);
-                    long serverTimestamp = fileStat.st_mtime;
+long monotonicMillis() 
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
 
-                    if (clientTimestamp > serverTimestamp) 
+unsigned hashName(const char* name) 
+{
+    unsigned hash = 5381;
+    for (; *name != '\0'; name++) 
+	{
+        hash = hash * 33 + (unsigned char)*name;
+    }
+    return hash % CHANGE_BUCKETS;
+}
+
+// Function to record a change to a file, merging it with one already pending
+void noteChange(const char* name, int created) 
+{
+    long now = monotonicMillis();
+    unsigned bucket = hashName(name);
+    for (Change* change = changeBuckets[bucket]; change != NULL; change = change->chain) 
+	{
+        if (strcmp(change->name, name) == 0) 
+		{
+            change->lastSeen = now;
+            return;
+        }
+    }
+
+    Change* change = calloc(1, sizeof(Change));
+    snprintf(change->name, sizeof(change->name), "%s", name);
+    change->created = created;
+    change->firstSeen = now;
+    change->lastSeen = now;
+    change->chain = changeBuckets[bucket];
+    changeBuckets[bucket] = change;
+    if (changesTail == NULL) 
+	{
+        changesHead = change;
+    }
+	else 
+	{
+        changesTail->next = change;
+    }
+    changesTail = change;
+}
+
+// Function to send a change to the server: what the file looks like now decides
+// whether it is uploaded, deleted or left alone
+void applyChange(const Change* change) 
+{
+    char filePath[PATH_MAX];
+    snprintf(filePath, sizeof(filePath), "%s/%s", clientDir, change->name);
+
+    struct stat fileStat;
+    if (lstat(filePath, &fileStat) == -1) 
+	{
+        if (!change->created) 
+		{
+            sendRequest(FRAME_DELETE, change->name, 0);
+        }
+    }
+	else if (S_ISREG(fileStat.st_mode) && !isDownloaded(change->name, &fileStat)) 
+	{
+        // Below a block there is nothing to gain from asking for a signature first
+        if (fileStat.st_size < MIN_BLOCK_SIZE) 
+		{
+            sendFile(filePath, change->name);
+        }
+		else 
+		{
+            sendDelta(filePath, change->name);
+        }
+    }
+}
+
+// Function to send the changes that are due, or all of them. Returns the milliseconds
+// until the next one is due, or -1 if none are pending.
+int flushChanges(int all) 
+{
+    long now = monotonicMillis();
+    long wait = -1;
+    Change* previous = NULL;
+    Change* change = changesHead;
+
+    while (change != NULL) 
+	{
+        long due = change->lastSeen + DEBOUNCE_MS;
+        if (due > change->firstSeen + MAX_DELAY_MS) 
+		{
+            due = change->firstSeen + MAX_DELAY_MS;
+        }
+        if (!all && due > now) 
+		{
+            wait = wait == -1 || due - now < wait ? due - now : wait;
+            previous = change;
+            change = change->next;
+            continue;
+        }
+
+        // Take it out of the queue and the lookup before sending, which may take a while
+        Change* next = change->next;
+        if (previous == NULL) 
+		{
+            changesHead = next;
+        }
+		else 
+		{
+            previous->next = next;
+        }
+        if (changesTail == change) 
+		{
+            changesTail = previous;
+        }
+        Change** link = &changeBuckets[hashName(change->name)];
+        while (*link != change) 
+		{
+            link = &(*link)->chain;
+        }
+        *link = change->chain;
+
+        applyChange(change);
+        free(change);
+        change = next;
+    }
+    return (int)wait;
+}
+
+// Function to watch a directory and every directory below it, collecting the names of
+// the files in them if files is given. Watching comes first, so a file created meanwhile
+// is not missed.
+void watchTree(const char* relative, NameList* files) 
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", clientDir, relative[0] ? "/" : "", relative);
+
+    int wd = inotify_add_watch(inotifyFd, path, WATCH_MASK | IN_ONLYDIR);
+    if (wd == -1) 
+	{
+        perror("Error watching directory");
+        return;
+    }
+    if (wd >= watchCapacity) 
+	{
+        int capacity = wd * 2 + 16;
+        watchPaths = realloc(watchPaths, capacity * sizeof(char*));
+        memset(watchPaths + watchCapacity, 0, (capacity - watchCapacity) * sizeof(char*));
+        watchCapacity = capacity;
+    }
+    // A directory renamed inside the tree keeps its watch, under the new name
+    free(watchPaths[wd]);
+    watchPaths[wd] = strdup(relative);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) 
+	{
+        perror("Error opening directory");
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) 
+	{
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || isTempName(entry->d_name)) 
+		{
+            continue;
+        }
+
+        char name[BUFFER_SIZE];
+        const char* separator = relative[0] ? "/" : "";
+        if (snprintf(name, sizeof(name), "%s%s%s", relative, separator, entry->d_name) > MAX_NAME_LENGTH) 
+		{
+            continue;
+        }
+        if (entry->d_type == DT_DIR) 
+		{
+            watchTree(name, files);
+        }
+		else if (entry->d_type == DT_REG && files != NULL) 
+		{
+            if (files->count == files->capacity) 
+			{
+                files->capacity = files->capacity ? files->capacity * 2 : 64;
+                files->names = realloc(files->names, files->capacity * sizeof(*files->names));
+            }
+            snprintf(files->names[files->count++], BUFFER_SIZE, "%s", name);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to carry out one entry of the merge walk: send the client's copy, or ask for
+// the server's
+void transferFile(const ManifestEntry* clientEntry, const ManifestEntry* serverEntry, SyncDirection direction,
+                  void* context) 
+{
+    int* counts = context;
+    counts[direction]++;
+
+    if (direction == SYNC_DOWNLOAD) 
+	{
+        sendRequest(FRAME_DOWNLOAD, serverEntry->name, 0);
+        return;
+    }
+
+    char filePath[PATH_MAX];
+    snprintf(filePath, sizeof(filePath), "%s/%s", clientDir, clientEntry->name);
+    if (serverEntry != NULL && serverEntry->size > 0 && clientEntry->size >= MIN_BLOCK_SIZE) 
+	{
+        sendDelta(filePath, clientEntry->name);
+    }
+	else 
+	{
+        sendFile(filePath, clientEntry->name);
+    }
+}
+
+// Function to compare the whole directory with the server: at startup, and again when
+// the kernel dropped events and changes may have been missed. The two sides swap sorted
+// manifests in one round trip and a merge walk over them decides what to transfer.
+void rescan() 
+{
+    watchTree("", NULL);
+
+    Manifest clientManifest;
+    buildManifest(&clientManifest, clientDir, NULL, NULL);
+    size_t length;
+    unsigned char* encoded = encodeManifest(&clientManifest, &length);
+    if (length > MAX_MANIFEST_SIZE) 
+	{
+        fprintf(stderr, "Too many files to synchronize (%zu)\n", clientManifest.count);
+        free(encoded);
+        freeManifest(&clientManifest);
+        return;
+    }
+
+    PendingRequest* request = sendData(FRAME_MANIFEST, "directory", encoded, length, 1);
+    free(encoded);
+    waitForAnswer(request);
+
+    Manifest serverManifest;
+    if (request->status != STATUS_OK || !decodeManifest(&serverManifest, request->result, request->resultLength)) 
+	{
+        fprintf(stderr, "Server could not compare the directory: %s\n",
+                request->status != STATUS_OK ? statusName(request->status) : "bad manifest");
+        freeRequest(request);
+        freeManifest(&clientManifest);
+        return;
+    }
+    freeRequest(request);
+
+    int counts[2] = { 0, 0 };
+    printf("Server holds %zu files, client %zu\n", serverManifest.count, clientManifest.count);
+    compareManifests(&clientManifest, &serverManifest, transferFile, counts);
+    if (counts[SYNC_UPLOAD] > 0 || counts[SYNC_DOWNLOAD] > 0) 
+	{
+        printf("Synchronizing: %d to upload, %d to download\n", counts[SYNC_UPLOAD], counts[SYNC_DOWNLOAD]);
+    }
+
+    freeManifest(&clientManifest);
+    freeManifest(&serverManifest);
+}
+
+// Function to handle a directory moved away: its files are gone from here, so each one
+// the server holds below it is queued for deletion, and the watches below it are dropped.
+// A directory moved within the tree is picked up again under its new name.
+void forgetTree(const char* name) 
+{
+    size_t nameLength = strlen(name);
+    for (int wd = 0; wd < watchCapacity; wd++) 
+	{
+        if (watchPaths[wd] != NULL && strncmp(watchPaths[wd], name, nameLength) == 0 &&
+            (watchPaths[wd][nameLength] == '\0' || watchPaths[wd][nameLength] == '/')) 
+		{
+            inotify_rm_watch(inotifyFd, wd);
+            free(watchPaths[wd]);
+            watchPaths[wd] = NULL;
+        }
+    }
+
+    // Nothing here lists the files any more; the server's manifest does
+    PendingRequest* request = sendData(FRAME_MANIFEST, "directory", NULL, 0, 1);
+    waitForAnswer(request);
+    Manifest serverManifest;
+    if (request->status != STATUS_OK || !decodeManifest(&serverManifest, request->result, request->resultLength)) 
+	{
+        fprintf(stderr, "Server could not list %s: %s\n", name,
+                request->status != STATUS_OK ? statusName(request->status) : "bad manifest");
+        freeRequest(request);
+        return;
+    }
+    freeRequest(request);
+
+    for (size_t i = 0; i < serverManifest.count; i++) 
+	{
+        const char* entryName = serverManifest.entries[i].name;
+        if (strncmp(entryName, name, nameLength) == 0 && entryName[nameLength] == '/') 
+		{
+            noteChange(entryName, 0);
+        }
+    }
+    freeManifest(&serverManifest);
+}
+
+// Function to turn the events read from inotify into changes. Returns 0 if the kernel
+// dropped events.
+int readEvents(char* buffer) 
+{
+    int complete = 1;
+    ssize_t length;
+    while ((length = read(inotifyFd, buffer, EVENT_BUFFER_SIZE)) > 0) 
+	{
+        for (ssize_t offset = 0; offset < length; ) 
+		{
+            struct inotify_event event;
+            memcpy(&event, buffer + offset, sizeof(event));
+            const char* entryName = buffer + offset + sizeof(event);
+            offset += sizeof(event) + event.len;
+
+            if (event.mask & IN_Q_OVERFLOW) 
+			{
+                complete = 0;
+                continue;
+            }
+            if (event.wd < 0 || event.wd >= watchCapacity || watchPaths[event.wd] == NULL) 
+			{
+                continue;
+            }
+            if (event.mask & IN_IGNORED) 
+			{
+                // The directory is gone; its watch number may be handed out again
+                free(watchPaths[event.wd]);
+                watchPaths[event.wd] = NULL;
+                continue;
+            }
+            if (event.len == 0 || isTempName(entryName)) 
+			{
+                continue;
+            }
+
+            const char* directory = watchPaths[event.wd];
+            char name[BUFFER_SIZE];
+            const char* separator = directory[0] ? "/" : "";
+            if (snprintf(name, sizeof(name), "%s%s%s", directory, separator, entryName) > MAX_NAME_LENGTH) 
+			{
+                continue;
+            }
+
+            if (event.mask & IN_ISDIR) 
+			{
+                // A new directory may already hold files by the time it is watched
+                if (event.mask & (IN_CREATE | IN_MOVED_TO)) 
+				{
+                    NameList files = { NULL, 0, 0 };
+                    watchTree(name, &files);
+                    for (int i = 0; i < files.count; i++) 
 					{
-                        // Client file is newer, so send it
-                        sendFile(serverSocket, filePath);
+                        noteChange(files.names[i], 0);
                     }
+                    free(files.names);
+                }
+				else if (event.mask & IN_MOVED_FROM) 
+				{
+                    forgetTree(name);
                 }
+                continue;
             }
+            noteChange(name, (event.mask & (IN_CREATE | IN_MOVED_TO)) != 0);
         }
+    }
+    if (length == -1 && errno != EAGAIN && errno != EINTR) 
+	{
+        perror("Error reading file events");
+    }
+    return complete;
+}
 
-        closedir(dir);
+// Function to keep the server up to date with the client directory. The directory is
+// compared in full once; after that only files the kernel reports as changed are sent.
+void* watchDirectory(void* arg) 
+{
+    char buffer[EVENT_BUFFER_SIZE];
+
+    rescan();
 
-        sleep(5); // Check for changes every 5 seconds
+    int stopping = 0;
+    while (!stopping) 
+	{
+        int timeout = flushChanges(0);
+
+        struct pollfd sources[2] = { { inotifyFd, POLLIN, 0 }, { stopEvent, POLLIN, 0 } };
+        if (poll(sources, 2, timeout) == -1 && errno != EINTR) 
+		{
+            perror("Error waiting for file events");
+            break;
+        }
+        stopping = sources[1].revents != 0;
+        if ((sources[0].revents & POLLIN) && !readEvents(buffer)) 
+		{
+            fprintf(stderr, "Too many changes at once, comparing the whole directory\n");
+            rescan();
+        }
     }
 
-    close(serverSocket);
-    free(arg);
+    // Whatever is still waiting for its quiet period goes out now
+    flushChanges(1);
     return NULL;
 }
 
@@ -188,8 +1168,8 @@ int main(int argc, char* argv[])
     signal(SIGINT, handleSIGINT);
 
     // Create client socket
-    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientSocket == -1) 
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == -1) 
 	{
         perror("Error creating socket");
         exit(EXIT_FAILURE);
@@ -206,22 +1186,50 @@ int main(int argc, char* argv[])
     }
 
     // Connect to the server
-    if (connect(clientSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) 
+    if (connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) == -1) 
 	{
         perror("Error connecting to server");
         exit(EXIT_FAILURE);
     }
 
+    pthread_t receiveThread;
+    if (pthread_create(&receiveThread, NULL, receiveAnswers, NULL) != 0) 
+	{
+        perror("Error creating thread");
+        exit(EXIT_FAILURE);
+    }
+
+    // Send client directory name to the server
+    char dirName[BUFFER_SIZE];
+    snprintf(dirName, sizeof(dirName), "%s", clientDir);
+    while (strlen(dirName) > 1 && dirName[strlen(dirName) - 1] == '/') 
+	{
+        dirName[strlen(dirName) - 1] = '\0';
+    }
+    PendingRequest* hello = sendRequest(FRAME_HELLO, strrchr(dirName, '/') ? strrchr(dirName, '/') + 1 : dirName, 1);
+    waitForAnswer(hello);
+    if (hello->status != STATUS_OK) 
+	{
+        fprintf(stderr, "Server refused directory %s: %s\n", hello->name, statusName(hello->status));
+        exit(EXIT_FAILURE);
+    }
+    printf("Connected to server as %s\n", hello->name);
+    freeRequest(hello);
+
     // Synchronize directory with server in a separate thread
-    pthread_t syncThread;
-    int* syncSocket = malloc(sizeof(int));
-    *syncSocket = clientSocket;
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stopEvent = eventfd(0, EFD_CLOEXEC);
+    if (inotifyFd == -1 || stopEvent == -1) 
+	{
+        perror("Error setting up file events");
+        exit(EXIT_FAILURE);
+    }
 
-    if (pthread_create(&syncThread, NULL, synchronize, syncSocket) != 0) 
+    pthread_t syncThread;
+    if (pthread_create(&syncThread, NULL, watchDirectory, NULL) != 0) 
 	{
         perror("Error creating thread");
-        close(clientSocket);
-        free(syncSocket);
+        close(serverSocket);
         exit(EXIT_FAILURE);
     }
 
@@ -231,108 +1239,72 @@ int main(int argc, char* argv[])
     while (1) 
 	{
         printf("Enter command (upload, delete, update, exit): ");
-        fgets(buffer, sizeof(buffer), stdin);
+        if (fgets(buffer, sizeof(buffer), stdin) == NULL) 
+		{
+            break;
+        }
 
         // Remove newline character
         buffer[strcspn(buffer, "\n")] = '\0';
 
-        if (strcmp(buffer, "upload") == 0) {
-            printf("Enter filename to upload: ");
-            fgets(buffer, sizeof(buffer), stdin);
+        if (strcmp(buffer, "upload") == 0 || strcmp(buffer, "update") == 0) 
+		{
+            // An upload replaces the server's copy; an update sends only what changed
+            int update = strcmp(buffer, "update") == 0;
+            printf("Enter filename to %s: ", buffer);
+            if (fgets(buffer, sizeof(buffer), stdin) == NULL) 
+			{
+                break;
+            }
             buffer[strcspn(buffer, "\n")] = '\0';
 
-            send(clientSocket, "upload:", strlen("upload:"), 0);
-            send(clientSocket, buffer, strlen(buffer), 0);
-
-            FILE* file = fopen(buffer, "rb");
-            if (file == NULL) {
-                perror("Error opening file");
-                continue;
+            const char* name = strrchr(buffer, '/') ? strrchr(buffer, '/') + 1 : buffer;
+            if (update) 
+			{
+                sendDelta(buffer, name);
             }
-
-            while (1) 
+			else 
 			{
-                size_t bytesRead = fread(buffer, 1, sizeof(buffer), file);
-                if (bytesRead > 0) {
-                    send(clientSocket, buffer, bytesRead, 0);
-                }
-
-                if (bytesRead < sizeof(buffer)) 
-				{
-                    if (feof(file)) 
-					{
-                        break;
-                    } else if (ferror(file)) 
-					{
-                        perror("Error reading from file");
-                        break;
-                    }
-                }
+                sendFile(buffer, name);
             }
-
-            fclose(file);
-        } 
+        }
 		else if (strcmp(buffer, "delete") == 0) 
 		{
             printf("Enter filename to delete: ");
-            fgets(buffer, sizeof(buffer), stdin);
-            buffer[strcspn(buffer, "\n")] = '\0';
-
-            send(clientSocket, "delete:", strlen("delete:"), 0);
-            send(clientSocket, buffer, strlen(buffer), 0);
-        } 
-		else if (strcmp(buffer, "update") == 0) 
-		{
-            printf("Enter filename to update: ");
-            fgets(buffer, sizeof(buffer), stdin);
-            buffer[strcspn(buffer, "\n")] = '\0';
-
-            send(clientSocket, "update:", strlen("update:"), 0);
-            send(clientSocket, buffer, strlen(buffer), 0);
-
-            FILE* file = fopen(buffer, "rb");
-            
-			if (file == NULL) 
+            if (fgets(buffer, sizeof(buffer), stdin) == NULL) 
 			{
-                perror("Error opening file");
-                continue;
-            }
-
-            while (1) 
-			{
-                size_t bytesRead = fread(buffer, 1, sizeof(buffer), file);
-                if (bytesRead > 0) {
-                    send(clientSocket, buffer, bytesRead, 0);
-                }
-
-                if (bytesRead < sizeof(buffer)) {
-                    if (feof(file)) {
-                        break;
-                    } else if (ferror(file)) {
-                        perror("Error reading from file");
-                        break;
-                    }
-                }
+                break;
             }
+            buffer[strcspn(buffer, "\n")] = '\0';
 
-            fclose(file);
-        } 
+            sendRequest(FRAME_DELETE, buffer, 0);
+        }
 		else if (strcmp(buffer, "exit") == 0) {
             break;
-        } 
+        }
 		else 
 		{
             printf("Invalid command\n");
         }
     }
 
-    // Terminate synchronization thread
-    pthread_cancel(syncThread);
+    // Stop the watcher; it sends the changes it is still holding first
+    uint64_t stop = 1;
+    if (write(stopEvent, &stop, sizeof(stop)) == -1) 
+	{
+        perror("Error stopping synchronization");
+    }
     pthread_join(syncThread, NULL);
 
-    close(clientSocket);
-    free(syncSocket);
+    // Let the server answer everything already sent
+    pthread_mutex_lock(&pendingMutex);
+    while (pendingHead != NULL) 
+	{
+        pthread_cond_wait(&answered, &pendingMutex);
+    }
+    pthread_mutex_unlock(&pendingMutex);
+
+    close(serverSocket);
 
     return 0;
 }
-
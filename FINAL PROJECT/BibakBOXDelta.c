@@ -0,0 +1,153 @@
+#include <string.h>
+#include "BibakBOXDelta.h"
+
+// MD5 (RFC 1321); the per-step constants and rotations
+static const uint32_t md5Constants[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5Shifts[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static void md5Block(uint32_t state[4], const unsigned char* block) 
+{
+    uint32_t words[16];
+    for (int i = 0; i < 16; i++) 
+	{
+        words[i] = (uint32_t)block[4 * i] | (uint32_t)block[4 * i + 1] << 8 |
+                   (uint32_t)block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) 
+	{
+        uint32_t f;
+        int word;
+        if (i < 16) 
+		{
+            f = (b & c) | (~b & d);
+            word = i;
+        }
+		else if (i < 32) 
+		{
+            f = (d & b) | (~d & c);
+            word = (5 * i + 1) % 16;
+        }
+		else if (i < 48) 
+		{
+            f = b ^ c ^ d;
+            word = (3 * i + 5) % 16;
+        }
+		else 
+		{
+            f = c ^ (b | ~d);
+            word = (7 * i) % 16;
+        }
+
+        f += a + md5Constants[i] + words[word];
+        int shift = md5Shifts[i / 16 * 4 + i % 4];
+        a = d;
+        d = c;
+        c = b;
+        b += f << shift | f >> (32 - shift);
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void md5Init(Md5Context* context) 
+{
+    context->state[0] = 0x67452301;
+    context->state[1] = 0xefcdab89;
+    context->state[2] = 0x98badcfe;
+    context->state[3] = 0x10325476;
+    context->length = 0;
+}
+
+void md5Update(Md5Context* context, const void* data, size_t length) 
+{
+    const unsigned char* next = data;
+    size_t used = context->length % 64;
+    context->length += length;
+
+    if (used > 0) 
+	{
+        size_t take = 64 - used < length ? 64 - used : length;
+        memcpy(context->buffer + used, next, take);
+        next += take;
+        length -= take;
+        if (used + take < 64) 
+		{
+            return;
+        }
+        md5Block(context->state, context->buffer);
+    }
+
+    for (; length >= 64; next += 64, length -= 64) 
+	{
+        md5Block(context->state, next);
+    }
+    memcpy(context->buffer, next, length);
+}
+
+void md5Final(Md5Context* context, unsigned char digest[STRONG_HASH_SIZE]) 
+{
+    unsigned char padding[72] = { 0x80 };
+    uint64_t bits = context->length * 8;
+    size_t used = context->length % 64;
+    size_t padLength = (used < 56 ? 56 : 120) - used;
+
+    for (int i = 0; i < 8; i++) 
+	{
+        padding[padLength + i] = bits >> (8 * i);
+    }
+    md5Update(context, padding, padLength + 8);
+
+    for (int i = 0; i < 16; i++) 
+	{
+        digest[i] = context->state[i / 4] >> (8 * (i % 4));
+    }
+}
+
+uint32_t weakChecksum(const unsigned char* data, size_t length) 
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; i++) 
+	{
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffff) | b << 16;
+}
+
+// a is the byte sum and b the sum weighted by distance from the block end, both mod 2^16:
+// dropping a byte removes it from a and length times it from b, and every byte left moves
+// one place further from the end, which adds the new a to b
+uint32_t rollChecksum(uint32_t checksum, size_t length, unsigned char out, unsigned char in) 
+{
+    uint32_t a = ((checksum & 0xffff) - out + in) & 0xffff;
+    uint32_t b = ((checksum >> 16) - (uint32_t)length * out + a) & 0xffff;
+    return a | b << 16;
+}
+
+uint32_t chooseBlockSize(uint64_t fileSize) 
+{
+    uint64_t root = 1;
+    while (root * root < fileSize && root < MAX_BLOCK_SIZE) 
+	{
+        root *= 2;
+    }
+
+    // The next power of two is within a factor of two of the square root, close enough
+    return root < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : root;
+}
@@ -0,0 +1,48 @@
+#ifndef BIBAKBOX_DELTA_H
+#define BIBAKBOX_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Block delta transfer, after rsync. The server splits its copy of a file into blocks
+// and sends a signature of each: a weak checksum that can be rolled one byte at a time
+// and a strong hash. The client slides a block-sized window over its copy and sends
+// references to the blocks the server already has and literal bytes for the rest.
+//
+// Signature (FRAME_SIGNATURE status payload):
+//   u32 block size | per whole block: u32 weak checksum, 16-byte MD5
+// Delta instructions (FRAME_DELTA payload, after its header):
+//   DELTA_COPY u32 first block u32 block count | DELTA_LITERAL u32 length, bytes
+
+#define STRONG_HASH_SIZE 16
+#define SIGNATURE_ENTRY_SIZE (4 + STRONG_HASH_SIZE)
+#define DELTA_HEADER_SIZE (4 + 8 + STRONG_HASH_SIZE)    // block size, new size, new MD5
+#define MIN_BLOCK_SIZE 2048
+#define MAX_BLOCK_SIZE (1 << 20)
+
+typedef enum 
+{
+    DELTA_COPY = 1,
+    DELTA_LITERAL
+} DeltaOp;
+
+typedef struct 
+{
+    uint32_t state[4];
+    uint64_t length;
+    unsigned char buffer[64];
+} Md5Context;
+
+void md5Init(Md5Context* context);
+void md5Update(Md5Context* context, const void* data, size_t length);
+void md5Final(Md5Context* context, unsigned char digest[STRONG_HASH_SIZE]);
+
+// Weak checksum of a block, and the checksum of the block one byte further on
+uint32_t weakChecksum(const unsigned char* data, size_t length);
+uint32_t rollChecksum(uint32_t checksum, size_t length, unsigned char out, unsigned char in);
+
+// Block size for a file: about the square root of its size, so the signature and the
+// matching work both grow with the square root as well
+uint32_t chooseBlockSize(uint64_t fileSize);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "BibakBOXProtocol.h"
+#include "BibakBOXManifest.h"
+
+#define HASH_BUFFER_SIZE 65536
+
+int isTempName(const char* name) 
+{
+    return strncmp(name, ".bibakbox-", 10) == 0;
+}
+
+// Function to hash the contents of a file; returns 0 if it cannot be read
+int hashFile(const char* path, unsigned char* hash) 
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) 
+	{
+        return 0;
+    }
+
+    unsigned char* buffer = malloc(HASH_BUFFER_SIZE);
+    Md5Context context;
+    md5Init(&context);
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer, 1, HASH_BUFFER_SIZE, file)) > 0) 
+	{
+        md5Update(&context, buffer, bytesRead);
+    }
+    int failed = ferror(file);
+    md5Final(&context, hash);
+
+    free(buffer);
+    fclose(file);
+    return !failed;
+}
+
+int compareEntries(const void* first, const void* second) 
+{
+    return strcmp(((const ManifestEntry*)first)->name, ((const ManifestEntry*)second)->name);
+}
+
+// Function to find the hash of a file in an earlier manifest, if the file has not been
+// touched since; returns 0 if it must be read again
+int reuseHash(const Manifest* previous, const char* name, const struct stat* fileStat, unsigned char* hash) 
+{
+    if (previous == NULL) 
+	{
+        return 0;
+    }
+    ManifestEntry key = { .name = (char*)name };
+    const ManifestEntry* entry = bsearch(&key, previous->entries, previous->count, sizeof(ManifestEntry), compareEntries);
+    if (entry == NULL || entry->size != (uint64_t)fileStat->st_size || entry->mtime != fileStat->st_mtime ||
+        entry->changeTime != fileStat->st_ctim.tv_sec * 1000000000LL + fileStat->st_ctim.tv_nsec) 
+	{
+        return 0;
+    }
+    memcpy(hash, entry->hash, STRONG_HASH_SIZE);
+    return 1;
+}
+
+// Function to add the files below a directory to a manifest
+void addDirectory(Manifest* manifest, const char* path, const char* prefix, const char* exclude,
+                  const Manifest* previous) 
+{
+    DIR* dir = opendir(path);
+    if (dir == NULL) 
+	{
+        perror("Error opening directory");
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) 
+	{
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || isTempName(entry->d_name) ||
+            (prefix[0] == '\0' && exclude != NULL && strcmp(entry->d_name, exclude) == 0)) 
+		{
+            continue;
+        }
+
+        char name[MAX_NAME_LENGTH + 2];
+        char child[PATH_MAX];
+        if (snprintf(name, sizeof(name), "%s%s", prefix, entry->d_name) > MAX_NAME_LENGTH) 
+		{
+            continue;   // longer than the protocol can carry
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+        struct stat fileStat;
+        if (lstat(child, &fileStat) == -1) 
+		{
+            continue;
+        }
+        if (S_ISDIR(fileStat.st_mode)) 
+		{
+            char childPrefix[MAX_NAME_LENGTH + 3];
+            snprintf(childPrefix, sizeof(childPrefix), "%s/", name);
+            addDirectory(manifest, child, childPrefix, exclude, previous);
+            continue;
+        }
+        if (!S_ISREG(fileStat.st_mode)) 
+		{
+            continue;
+        }
+
+        if (manifest->count == manifest->capacity) 
+		{
+            manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+            manifest->entries = realloc(manifest->entries, manifest->capacity * sizeof(ManifestEntry));
+        }
+        ManifestEntry* file = &manifest->entries[manifest->count];
+        if (!reuseHash(previous, name, &fileStat, file->hash) && !hashFile(child, file->hash)) 
+		{
+            perror("Error reading file");
+            continue;
+        }
+        file->name = strdup(name);
+        file->size = fileStat.st_size;
+        file->mtime = fileStat.st_mtime;
+        file->changeTime = fileStat.st_ctim.tv_sec * 1000000000LL + fileStat.st_ctim.tv_nsec;
+        manifest->count++;
+    }
+
+    closedir(dir);
+}
+
+void buildManifest(Manifest* manifest, const char* root, const char* exclude, const Manifest* previous) 
+{
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+    addDirectory(manifest, root, "", exclude, previous);
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compareEntries);
+}
+
+unsigned char* encodeManifest(const Manifest* manifest, size_t* length) 
+{
+    *length = 0;
+    for (size_t i = 0; i < manifest->count; i++) 
+	{
+        *length += 2 + strlen(manifest->entries[i].name) + 16 + STRONG_HASH_SIZE;
+    }
+
+    unsigned char* data = malloc(*length ? *length : 1);
+    unsigned char* next = data;
+    for (size_t i = 0; i < manifest->count; i++) 
+	{
+        const ManifestEntry* entry = &manifest->entries[i];
+        size_t nameLength = strlen(entry->name);
+        putUint16(next, nameLength);
+        memcpy(next + 2, entry->name, nameLength);
+        next += 2 + nameLength;
+        putUint64(next, entry->size);
+        putUint64(next + 8, (uint64_t)entry->mtime);
+        memcpy(next + 16, entry->hash, STRONG_HASH_SIZE);
+        next += 16 + STRONG_HASH_SIZE;
+    }
+    return data;
+}
+
+int decodeManifest(Manifest* manifest, const unsigned char* data, size_t length) 
+{
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+
+    size_t offset = 0;
+    while (offset < length) 
+	{
+        size_t nameLength = length - offset >= 2 ? getUint16(data + offset) : 0;
+        size_t entryLength = 2 + nameLength + 16 + STRONG_HASH_SIZE;
+        if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || length - offset < entryLength) 
+		{
+            freeManifest(manifest);
+            return 0;
+        }
+
+        char* name = malloc(nameLength + 1);
+        memcpy(name, data + offset + 2, nameLength);
+        name[nameLength] = '\0';
+        const char* base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+        int sorted = manifest->count == 0 || strcmp(manifest->entries[manifest->count - 1].name, name) < 0;
+        if (strlen(name) != nameLength || !isSafeName(name) || isTempName(base) || !sorted) 
+		{
+            free(name);
+            freeManifest(manifest);
+            return 0;
+        }
+
+        if (manifest->count == manifest->capacity) 
+		{
+            manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+            manifest->entries = realloc(manifest->entries, manifest->capacity * sizeof(ManifestEntry));
+        }
+        ManifestEntry* entry = &manifest->entries[manifest->count++];
+        const unsigned char* fields = data + offset + 2 + nameLength;
+        entry->name = name;
+        entry->size = getUint64(fields);
+        entry->mtime = (int64_t)getUint64(fields + 8);
+        entry->changeTime = 0;
+        memcpy(entry->hash, fields + 16, STRONG_HASH_SIZE);
+        offset += entryLength;
+    }
+    return 1;
+}
+
+void freeManifest(Manifest* manifest) 
+{
+    for (size_t i = 0; i < manifest->count; i++) 
+	{
+        free(manifest->entries[i].name);
+    }
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = 0;
+    manifest->capacity = 0;
+}
+
+void compareManifests(const Manifest* client, const Manifest* server, SyncVisitor visit, void* context) 
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < client->count || j < server->count) 
+	{
+        const ManifestEntry* clientEntry = i < client->count ? &client->entries[i] : NULL;
+        const ManifestEntry* serverEntry = j < server->count ? &server->entries[j] : NULL;
+        int order = clientEntry == NULL ? 1 : serverEntry == NULL ? -1 : strcmp(clientEntry->name, serverEntry->name);
+
+        if (order < 0) 
+		{
+            visit(clientEntry, NULL, SYNC_UPLOAD, context);
+            i++;
+        }
+		else if (order > 0) 
+		{
+            visit(NULL, serverEntry, SYNC_DOWNLOAD, context);
+            j++;
+        }
+		else 
+		{
+            if (clientEntry->size != serverEntry->size ||
+                memcmp(clientEntry->hash, serverEntry->hash, STRONG_HASH_SIZE) != 0) 
+			{
+                visit(clientEntry, serverEntry, serverEntry->mtime > clientEntry->mtime ? SYNC_DOWNLOAD : SYNC_UPLOAD,
+                      context);
+            }
+            i++;
+            j++;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef BIBAKBOX_MANIFEST_H
+#define BIBAKBOX_MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "BibakBOXDelta.h"
+
+// A manifest lists every file below a directory, sorted by name, so two of them can be
+// compared in a single merge walk. Encoded, each entry is
+//
+//   u16 name length | name | u64 size | i64 mtime | 16-byte MD5 of the contents
+//
+// in network byte order, in the same order.
+
+#define MAX_MANIFEST_SIZE (64 << 20)
+
+typedef struct 
+{
+    char* name;                 // relative to the directory, '/'-separated
+    uint64_t size;
+    int64_t mtime;
+    unsigned char hash[STRONG_HASH_SIZE];
+    int64_t changeTime;         // ctime in nanoseconds; not sent, only used to reuse the hash
+} ManifestEntry;
+
+typedef struct 
+{
+    ManifestEntry* entries;
+    size_t count;
+    size_t capacity;
+} Manifest;
+
+typedef enum 
+{
+    SYNC_UPLOAD,                // the client's copy goes to the server
+    SYNC_DOWNLOAD               // the server's copy goes to the client
+} SyncDirection;
+
+// Called for every file the two sides disagree on; either entry is NULL if that side lacks the file
+typedef void (*SyncVisitor)(const ManifestEntry* clientEntry, const ManifestEntry* serverEntry,
+                            SyncDirection direction, void* context);
+
+// Temporary files of transfers in progress; renamed over the real name once complete
+int isTempName(const char* name);
+
+// Builds the manifest of a directory, leaving out temporary files and, if given, one
+// file at the top of it. A file that previous, an earlier manifest of the same directory
+// (or NULL), lists with the same size, mtime and ctime keeps its hash without being read.
+void buildManifest(Manifest* manifest, const char* root, const char* exclude, const Manifest* previous);
+unsigned char* encodeManifest(const Manifest* manifest, size_t* length);
+// Returns 0 if the data is malformed, unsorted or names a file outside the directory
+int decodeManifest(Manifest* manifest, const unsigned char* data, size_t length);
+void freeManifest(Manifest* manifest);
+
+// Merge walk deciding which files go which way. Identical contents need nothing; otherwise
+// the newer copy wins, and the client's on a tie.
+void compareManifests(const Manifest* client, const Manifest* server, SyncVisitor visit, void* context);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "BibakBOXProtocol.h"
+
+void putUint16(unsigned char* out, uint16_t value) 
+{
+    out[0] = value >> 8;
+    out[1] = value;
+}
+
+void putUint32(unsigned char* out, uint32_t value) 
+{
+    putUint16(out, value >> 16);
+    putUint16(out + 2, value);
+}
+
+void putUint64(unsigned char* out, uint64_t value) 
+{
+    putUint32(out, value >> 32);
+    putUint32(out + 4, value);
+}
+
+uint16_t getUint16(const unsigned char* in) 
+{
+    return (uint16_t)(in[0] << 8 | in[1]);
+}
+
+uint32_t getUint32(const unsigned char* in) 
+{
+    return (uint32_t)getUint16(in) << 16 | getUint16(in + 2);
+}
+
+uint64_t getUint64(const unsigned char* in) 
+{
+    return (uint64_t)getUint32(in) << 32 | getUint32(in + 4);
+}
+
+void encodeFrameHeader(unsigned char* out, uint8_t type, uint32_t requestId, uint64_t length) 
+{
+    out[0] = PROTOCOL_VERSION;
+    out[1] = type;
+    putUint16(out + 2, 0);
+    putUint32(out + 4, requestId);
+    putUint64(out + 8, length);
+}
+
+void decodeFrameHeader(const unsigned char* in, FrameHeader* header) 
+{
+    header->version = in[0];
+    header->type = in[1];
+    header->requestId = getUint32(in + 4);
+    header->length = getUint64(in + 8);
+}
+
+// Function to send a whole buffer over a blocking socket
+int sendAll(int socket, const void* data, size_t length) 
+{
+    const char* next = data;
+    while (length > 0) 
+	{
+        ssize_t sent = send(socket, next, length, MSG_NOSIGNAL);
+        if (sent > 0) 
+		{
+            next += sent;
+            length -= sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) 
+		{
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Function to receive exactly length bytes; returns -1 on error or end of stream
+int recvAll(int socket, void* data, size_t length) 
+{
+    char* next = data;
+    while (length > 0) 
+	{
+        ssize_t received = recv(socket, next, length, 0);
+        if (received > 0) 
+		{
+            next += received;
+            length -= received;
+            continue;
+        }
+        if (received == -1 && errno == EINTR) 
+		{
+            continue;
+        }
+        if (received == 0) 
+		{
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Function to send a frame whose payload is already in memory
+int sendFrame(int socket, uint8_t type, uint32_t requestId, const void* payload, size_t length) 
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header, type, requestId, length);
+    if (sendAll(socket, header, sizeof(header)) == -1) 
+	{
+        return -1;
+    }
+    return length > 0 ? sendAll(socket, payload, length) : 0;
+}
+
+int isSafeName(const char* name) 
+{
+    if (name[0] == '\0' || name[0] == '/' || strlen(name) > MAX_NAME_LENGTH) 
+	{
+        return 0;
+    }
+
+    for (const char* component = name; component != NULL; ) 
+	{
+        const char* slash = strchr(component, '/');
+        size_t length = slash != NULL ? (size_t)(slash - component) : strlen(component);
+        if (length == 0 || (length == 2 && strncmp(component, "..", 2) == 0)) 
+		{
+            return 0;
+        }
+        component = slash != NULL ? slash + 1 : NULL;
+    }
+    return 1;
+}
+
+const char* statusName(uint32_t status) 
+{
+    switch (status) 
+	{
+        case STATUS_OK: return "ok";
+        case STATUS_NOT_FOUND: return "not found";
+        case STATUS_ERROR: return "server error";
+        case STATUS_BAD_REQUEST: return "bad request";
+        case STATUS_BAD_VERSION: return "unsupported protocol version";
+    }
+    return "unknown status";
+}
@@ -0,0 +1,68 @@
+#ifndef BIBAKBOX_PROTOCOL_H
+#define BIBAKBOX_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format shared by the BibakBOX server and client. Every message is a frame:
+//
+//   u8 version | u8 type | u16 reserved | u32 request id | u64 payload length | payload
+//
+// in network byte order. A client may send many requests without waiting; the server
+// answers each with one FRAME_STATUS carrying the same request id, in request order.
+
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define MAX_NAME_LENGTH 1023            // file names, relative to the client directory
+#define MAX_REQUEST_PAYLOAD (1 << 20)   // buffered payloads; upload data is streamed
+
+typedef enum 
+{
+    FRAME_HELLO = 1,    // payload: client directory name
+    FRAME_UPLOAD,       // payload: u16 name length, name, file contents; replaces the file
+    FRAME_DELETE,       // payload: name
+    FRAME_CHECK,        // payload: name; status payload: i64 mtime, u64 size
+    FRAME_STATUS,       // payload: u32 status code, then what the request returns
+    FRAME_SIGNATURE,    // payload: name; status payload: block signature (BibakBOXDelta.h)
+    FRAME_DELTA,        // payload: u16 name length, name, delta header, instructions; rebuilds the file
+    FRAME_MANIFEST,     // payload: client manifest; status payload: server manifest (BibakBOXManifest.h)
+    FRAME_DOWNLOAD      // payload: name; status payload: file contents
+} FrameType;
+
+typedef enum 
+{
+    STATUS_OK,
+    STATUS_NOT_FOUND,
+    STATUS_ERROR,           // the server could not carry out the request
+    STATUS_BAD_REQUEST,     // malformed frame or name; the server closes the connection
+    STATUS_BAD_VERSION
+} StatusCode;
+
+typedef struct 
+{
+    uint8_t version;
+    uint8_t type;
+    uint32_t requestId;
+    uint64_t length;
+} FrameHeader;
+
+void putUint16(unsigned char* out, uint16_t value);
+void putUint32(unsigned char* out, uint32_t value);
+void putUint64(unsigned char* out, uint64_t value);
+uint16_t getUint16(const unsigned char* in);
+uint32_t getUint32(const unsigned char* in);
+uint64_t getUint64(const unsigned char* in);
+
+void encodeFrameHeader(unsigned char* out, uint8_t type, uint32_t requestId, uint64_t length);
+void decodeFrameHeader(const unsigned char* in, FrameHeader* header);
+
+// Blocking helpers for the client; the server queues its replies instead
+int sendAll(int socket, const void* data, size_t length);
+int recvAll(int socket, void* data, size_t length);
+int sendFrame(int socket, uint8_t type, uint32_t requestId, const void* payload, size_t length);
+
+// A name is safe if it stays inside the client directory: relative, no ".." component
+int isSafeName(const char* name);
+const char* statusName(uint32_t status);
+
+#endif
@@ -1,31 +1,127 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include "BibakBOXProtocol.h"
+#include "BibakBOXDelta.h"
+#include "BibakBOXManifest.h"
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 10
+#define MAX_EVENTS 64           // readiness events taken per epoll_wait
+#define READS_PER_EVENT 64      // reads before a busy client goes back to the end of the queue
+#define RECEIVE_SIZE 65536      // bytes a worker reads from a client at a time
+#define WRITES_PER_EVENT 64     // sends before a client with more to receive goes back to the end of the queue
+#define OUTPUT_LIMIT (1 << 20)  // queued reply bytes before a client's further requests wait
+#define MAX_QUEUED_DOWNLOADS 16 // queued downloads before a client's further requests wait
 
 int threadPoolSize;
 char* directory;
 int serverSocket;
+int epollFd;
+volatile sig_atomic_t running = 1;
 pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 int num_clients = 0;
+struct Connection* liveConnections = NULL;     // guarded by client_mutex
 
-// Struct to hold information about a file
+// A reply waiting to go out: bytes in memory, or a download, whose file is only opened
+// once every reply before it has been sent
+typedef struct Output 
+{
+    unsigned char* data;
+    size_t length;
+    size_t sent;
+    uint32_t requestId;             // downloads only
+    char* filePath;                 // downloads only
+    FILE* file;                     // open while the download is being sent
+    uint64_t remaining;             // download contents still to read
+    struct Output* next;
+} Output;
+
+// What a connection is reading
+typedef enum 
+{
+    READING_HEADER,     // the next frame header
+    READING_PAYLOAD,    // a request payload, buffered until it is complete
+    RECEIVING_FILE,     // upload contents, streamed to a temporary file
+    RECEIVING_DELTA,    // delta instructions, applied to the old file into a temporary file
+    DISCARDING          // the rest of an upload that could not be stored
+} ConnectionState;
+
+// One client socket. The reactor thread owns it while it waits in epoll; a worker owns
+// it from the time it is queued until it is re-armed, so only one thread touches it.
+typedef struct Connection 
+{
+    int socket;
+    ConnectionState state;
+    char clientName[BUFFER_SIZE];   // empty until FRAME_HELLO
+    char clientDir[1028];
+    unsigned char header[FRAME_HEADER_SIZE];
+    size_t headerBytes;
+    FrameHeader frame;              // request being read
+    unsigned char* payload;
+    size_t payloadBytes;
+    size_t payloadNeeded;           // bytes to buffer before acting on the request
+    uint64_t remaining;             // upload contents still to come
+    char fileName[BUFFER_SIZE];     // upload in progress
+    char tempPath[PATH_MAX];
+    FILE* file;
+    FILE* basis;                    // old contents a delta copies blocks from
+    uint64_t basisSize;
+    uint32_t blockSize;
+    uint64_t expectedSize;          // what the delta must rebuild
+    unsigned char expectedDigest[STRONG_HASH_SIZE];
+    Md5Context digest;              // of the contents written so far
+    uint64_t written;
+    unsigned char op[9];            // delta instruction being read
+    size_t opBytes;
+    uint32_t literalRemaining;
+    Output* outputHead;             // replies not yet sent, in request order
+    Output* outputTail;
+    size_t outputBytes;             // queued in memory
+    int queuedDownloads;
+    struct Connection* next;        // work queue link
+    struct Connection* liveNext;    // every open connection, to close them at shutdown
+    struct Connection* livePrevious;
+} Connection;
+
+// Connections with pending input, waiting for a worker
 typedef struct 
 {
-    char name[BUFFER_SIZE];
-    time_t accessTime;
-} FileEntry;
+    Connection* head;
+    Connection* tail;
+    int stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+} WorkQueue;
+
+WorkQueue workQueue = { NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// The last manifest built of each client directory, so the next one only hashes files
+// that changed since
+typedef struct ManifestCache 
+{
+    char clientDir[1028];
+    Manifest manifest;
+    struct ManifestCache* next;
+} ManifestCache;
+
+ManifestCache* manifestCaches = NULL;
+pthread_mutex_t manifestCacheMutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Function to write log entry to the client's logfile
 void writeLog(const char* clientDir, const char* message) 
@@ -52,156 +148,974 @@ void writeLog(const char* clientDir, const char* message)
     fclose(log);
 }
 
-// Function to synchronize directory contents with the client
-void synchronizeDirectory(int clientSocket, const char* clientDir) 
+// Function to queue a connection with pending input for the worker pool
+void pushConnection(Connection* connection) 
 {
-    char buffer[BUFFER_SIZE];
+    connection->next = NULL;
 
-    DIR* dir = opendir(clientDir);
-    if (dir == NULL) 
+    pthread_mutex_lock(&workQueue.mutex);
+    if (workQueue.tail == NULL) 
 	{
-        perror("Error opening directory");
-        return;
+        workQueue.head = connection;
+    }
+	else 
+	{
+        workQueue.tail->next = connection;
+    }
+    workQueue.tail = connection;
+    pthread_cond_signal(&workQueue.ready);
+    pthread_mutex_unlock(&workQueue.mutex);
+}
+
+// Function to take the next connection to serve; returns NULL once the server stops
+Connection* popConnection() 
+{
+    pthread_mutex_lock(&workQueue.mutex);
+    while (workQueue.head == NULL && !workQueue.stopping) 
+	{
+        pthread_cond_wait(&workQueue.ready, &workQueue.mutex);
     }
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) 
+    Connection* connection = workQueue.head;
+    if (connection != NULL && !workQueue.stopping) 
 	{
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) 
+        workQueue.head = connection->next;
+        if (workQueue.head == NULL) 
 		{
-            strcpy(buffer, entry->d_name);
-            send(clientSocket, buffer, strlen(buffer), 0);
-            memset(buffer, 0, sizeof(buffer));
+            workQueue.tail = NULL;
         }
     }
+	else 
+	{
+        connection = NULL;
+    }
+    pthread_mutex_unlock(&workQueue.mutex);
+    return connection;
+}
+
+// Function to add a reply to the end of a connection's output queue
+void queueOutput(Connection* connection, Output* output) 
+{
+    output->next = NULL;
+    if (connection->outputTail == NULL) 
+	{
+        connection->outputHead = output;
+    }
+	else 
+	{
+        connection->outputTail->next = output;
+    }
+    connection->outputTail = output;
+    connection->outputBytes += output->length;
+    connection->queuedDownloads += output->filePath != NULL;
+}
+
+// Function to check whether a client must wait for its replies before more requests are read
+int outputBacklogged(const Connection* connection) 
+{
+    return connection->outputBytes >= OUTPUT_LIMIT || connection->queuedDownloads >= MAX_QUEUED_DOWNLOADS;
+}
+
+// Function to answer a request; extra is the request's result, if any. The answer is
+// queued and goes out as the socket drains.
+int sendStatus(Connection* connection, uint32_t requestId, uint32_t status, const void* extra, size_t extraLength) 
+{
+    Output* output = calloc(1, sizeof(Output));
+    output->length = FRAME_HEADER_SIZE + 4 + extraLength;
+    output->data = malloc(output->length);
+    encodeFrameHeader(output->data, FRAME_STATUS, requestId, 4 + extraLength);
+    putUint32(output->data + FRAME_HEADER_SIZE, status);
+    if (extraLength > 0) 
+	{
+        memcpy(output->data + FRAME_HEADER_SIZE + 4, extra, extraLength);
+    }
+    queueOutput(connection, output);
+    return 0;
+}
 
-    closedir(dir);
+void countTransfer(const ManifestEntry* clientEntry, const ManifestEntry* serverEntry, SyncDirection direction,
+                   void* context) 
+{
+    ((int*)context)[direction]++;
 }
 
-// Function to handle a client connection
-void* handleClient(void* arg) 
+// Function to answer a client's manifest with the server's. Both sides run the same merge
+// walk over the two; the server only reports what the client is going to do.
+int exchangeManifests(Connection* connection, uint32_t requestId) 
 {
-    int clientSocket = *((int*)arg);
-    char buffer[BUFFER_SIZE];
+    Manifest clientManifest;
+    if (connection->clientName[0] == '\0' ||
+        !decodeManifest(&clientManifest, connection->payload, connection->payloadNeeded)) 
+	{
+        fprintf(stderr, "Bad manifest from %s\n", connection->clientName[0] ? connection->clientName : "new client");
+        sendStatus(connection, requestId, STATUS_BAD_REQUEST, NULL, 0);
+        return -1;
+    }
 
-    // Receive client directory name
-    ssize_t numBytes = recv(clientSocket, buffer, sizeof(buffer), 0);
-    if (numBytes <= 0) 
+    // The cached manifest is taken out while the new one is built; a second request for the
+    // same directory meanwhile simply hashes everything
+    pthread_mutex_lock(&manifestCacheMutex);
+    ManifestCache* cache = manifestCaches;
+    while (cache != NULL && strcmp(cache->clientDir, connection->clientDir) != 0) 
 	{
-        close(clientSocket);
-        return NULL;
+        cache = cache->next;
     }
+    if (cache == NULL) 
+	{
+        cache = calloc(1, sizeof(ManifestCache));
+        snprintf(cache->clientDir, sizeof(cache->clientDir), "%s", connection->clientDir);
+        cache->next = manifestCaches;
+        manifestCaches = cache;
+    }
+    Manifest previous = cache->manifest;
+    memset(&cache->manifest, 0, sizeof(cache->manifest));
+    pthread_mutex_unlock(&manifestCacheMutex);
 
-    buffer[numBytes] = '\0';
-    char clientDir[1028];
-   	snprintf(clientDir, sizeof(clientDir), "%s/%s", directory, buffer);
+    Manifest serverManifest;
+    buildManifest(&serverManifest, connection->clientDir, "logfile.txt", &previous);
+    freeManifest(&previous);
 
-    // Synchronize directory with client
-    synchronizeDirectory(clientSocket, clientDir);
+    int counts[2] = { 0, 0 };
+    compareManifests(&clientManifest, &serverManifest, countTransfer, counts);
+    printf("Manifest from %s: %zu files here, %d to upload, %d to download\n", connection->clientName,
+           serverManifest.count, counts[SYNC_UPLOAD], counts[SYNC_DOWNLOAD]);
 
-    printf("Client connected: %s\n", buffer);
+    size_t length;
+    unsigned char* encoded = encodeManifest(&serverManifest, &length);
+    int result = sendStatus(connection, requestId, STATUS_OK, encoded, length);
+    free(encoded);
+    freeManifest(&clientManifest);
 
-    while (1) 
+    pthread_mutex_lock(&manifestCacheMutex);
+    freeManifest(&cache->manifest);
+    cache->manifest = serverManifest;
+    pthread_mutex_unlock(&manifestCacheMutex);
+    return result;
+}
+
+// Function to queue a file as the answer to a download
+int sendDownload(Connection* connection, uint32_t requestId, const char* filePath) 
+{
+    Output* output = calloc(1, sizeof(Output));
+    output->requestId = requestId;
+    output->filePath = strdup(filePath);
+    queueOutput(connection, output);
+    return 0;
+}
+
+// Function to start sending a download that reached the front of the queue. Like uploads,
+// the length is fixed once the file is opened and a file that shrinks meanwhile is padded
+// with zeros.
+void startDownload(Output* output) 
+{
+    output->file = fopen(output->filePath, "rb");
+    struct stat fileStat;
+    uint32_t status = STATUS_OK;
+    if (output->file == NULL || fstat(fileno(output->file), &fileStat) == -1 || !S_ISREG(fileStat.st_mode)) 
 	{
-        // Receive client requests
-        numBytes = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (numBytes <= 0) 
+        status = output->file == NULL && errno == ENOENT ? STATUS_NOT_FOUND : STATUS_ERROR;
+        if (output->file != NULL) 
 		{
-            break;
+            fclose(output->file);
+            output->file = NULL;
         }
+    }
 
-        // Handle file operations
-        buffer[numBytes] = '\0';
-        char* operation = strtok(buffer, ":");
-        char* filename = strtok(NULL, ":");
+    output->remaining = status == STATUS_OK ? (uint64_t)fileStat.st_size : 0;
+    output->data = malloc(RECEIVE_SIZE);
+    output->length = FRAME_HEADER_SIZE + 4;
+    encodeFrameHeader(output->data, FRAME_STATUS, output->requestId, 4 + output->remaining);
+    putUint32(output->data + FRAME_HEADER_SIZE, status);
+}
+
+// Function to read the next piece of a download into its buffer
+void refillDownload(Output* output) 
+{
+    size_t chunk = output->remaining < RECEIVE_SIZE ? output->remaining : RECEIVE_SIZE;
+    size_t bytesRead = fread(output->data, 1, chunk, output->file);
+    if (bytesRead < chunk) 
+	{
+        memset(output->data + bytesRead, 0, chunk - bytesRead);
+    }
+    output->length = chunk;
+    output->sent = 0;
+    output->remaining -= chunk;
+}
+
+void freeOutput(Output* output) 
+{
+    if (output->file != NULL) 
+	{
+        fclose(output->file);
+    }
+    free(output->filePath);
+    free(output->data);
+    free(output);
+}
 
-        if (strcmp(operation, "upload") == 0) 
+// Function to send queued replies until the socket is full. Sends are non-blocking, so a
+// slow client never holds a worker. Returns -1 if the connection failed.
+int flushOutput(Connection* connection) 
+{
+    for (int writes = 0; writes < WRITES_PER_EVENT && connection->outputHead != NULL; ) 
+	{
+        Output* output = connection->outputHead;
+        if (output->filePath != NULL && output->data == NULL) 
 		{
-            FILE* file = fopen(filename, "wb");
-            if (file == NULL) 
+            startDownload(output);
+        }
+        if (output->sent == output->length) 
+		{
+            if (output->file != NULL && output->remaining > 0) 
 			{
-                perror("Error opening file");
+                refillDownload(output);
                 continue;
             }
-
-            while ((numBytes = recv(clientSocket, buffer, sizeof(buffer), 0)) > 0) 
+            connection->outputHead = output->next;
+            if (connection->outputHead == NULL) 
 			{
-                fwrite(buffer, 1, numBytes, file);
+                connection->outputTail = NULL;
             }
+            if (output->filePath != NULL) 
+			{
+                connection->queuedDownloads--;
+            }
+			else 
+			{
+                connection->outputBytes -= output->length;
+            }
+            freeOutput(output);
+            continue;
+        }
 
+        ssize_t sent = send(connection->socket, output->data + output->sent, output->length - output->sent,
+                            MSG_NOSIGNAL);
+        writes++;
+        if (sent > 0) 
+		{
+            output->sent += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR) 
+		{
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) 
+		{
+            return 0;
+        }
+        perror("Error sending to client");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to create the directories above a file in the client directory
+void makeParents(const char* filePath) 
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", filePath);
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) 
+	{
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Function to send the block signature of a file, for the client to compute a delta against
+int sendSignature(Connection* connection, uint32_t requestId, const char* filePath) 
+{
+    FILE* file = fopen(filePath, "rb");
+    struct stat fileStat;
+    if (file == NULL || fstat(fileno(file), &fileStat) == -1) 
+	{
+        uint32_t status = errno == ENOENT ? STATUS_NOT_FOUND : STATUS_ERROR;
+        if (status == STATUS_ERROR) 
+		{
+            perror("Error opening file");
+        }
+        if (file != NULL) 
+		{
             fclose(file);
-            printf("File uploaded: %s\n", filename);
-            writeLog(clientDir, filename);
-        } 
-		else if (strcmp(operation, "delete") == 0) 
+        }
+        return sendStatus(connection, requestId, status, NULL, 0);
+    }
+
+    // Only whole blocks are signed; the client sends the tail as literal data
+    uint32_t blockSize = chooseBlockSize(fileStat.st_size);
+    uint64_t blocks = fileStat.st_size / blockSize;
+    size_t length = 4 + blocks * SIGNATURE_ENTRY_SIZE;
+    unsigned char* signature = malloc(length);
+    unsigned char* block = malloc(blockSize);
+    putUint32(signature, blockSize);
+
+    uint32_t status = STATUS_OK;
+    for (uint64_t i = 0; i < blocks; i++) 
+	{
+        if (fread(block, 1, blockSize, file) != blockSize) 
+		{
+            perror("Error reading file");
+            status = STATUS_ERROR;
+            break;
+        }
+        unsigned char* entry = signature + 4 + i * SIGNATURE_ENTRY_SIZE;
+        Md5Context strong;
+        md5Init(&strong);
+        md5Update(&strong, block, blockSize);
+        putUint32(entry, weakChecksum(block, blockSize));
+        md5Final(&strong, entry + 4);
+    }
+    fclose(file);
+    free(block);
+
+    int result = sendStatus(connection, requestId, status, signature, status == STATUS_OK ? length : 0);
+    free(signature);
+    return result;
+}
+
+// Function to start receiving an uploaded file. The contents go to a temporary file
+// next to the real one, so a client that disconnects halfway leaves the old file as it was.
+void beginUpload(Connection* connection, const char* filename) 
+{
+    char filePath[PATH_MAX];
+    snprintf(filePath, sizeof(filePath), "%s/%s", connection->clientDir, filename);
+    makeParents(filePath);
+
+    const char* slash = strrchr(filename, '/');
+    snprintf(connection->tempPath, sizeof(connection->tempPath), "%s/%.*s.bibakbox-%s", connection->clientDir,
+             slash != NULL ? (int)(slash - filename + 1) : 0, filename, slash != NULL ? slash + 1 : filename);
+    snprintf(connection->fileName, sizeof(connection->fileName), "%s", filename);
+    connection->file = fopen(connection->tempPath, "wb");
+    if (connection->file == NULL) 
+	{
+        perror("Error opening file");
+    }
+    connection->state = connection->file != NULL ? RECEIVING_FILE : DISCARDING;
+}
+
+// Function to start rebuilding a file from a delta against the copy the server holds.
+// The new contents go to a temporary file just like an upload.
+void beginDelta(Connection* connection, const char* filename, const unsigned char* parameters) 
+{
+    connection->blockSize = getUint32(parameters);
+    connection->expectedSize = getUint64(parameters + 4);
+    memcpy(connection->expectedDigest, parameters + 12, STRONG_HASH_SIZE);
+    md5Init(&connection->digest);
+    connection->written = 0;
+    connection->opBytes = 0;
+    connection->literalRemaining = 0;
+
+    char filePath[PATH_MAX];
+    snprintf(filePath, sizeof(filePath), "%s/%s", connection->clientDir, filename);
+    connection->basis = fopen(filePath, "rb");
+    struct stat fileStat;
+    if (connection->basis == NULL || fstat(fileno(connection->basis), &fileStat) == -1) 
+	{
+        perror("Error opening file");
+        if (connection->basis != NULL) 
 		{
-            char filePath[1200];
-            sprintf(filePath, "%s/%s", clientDir, filename);
+            fclose(connection->basis);
+            connection->basis = NULL;
+        }
+    }
+
+    beginUpload(connection, filename);
+    if (connection->basis != NULL && connection->state == RECEIVING_FILE && connection->blockSize > 0) 
+	{
+        connection->basisSize = fileStat.st_size;
+        connection->state = RECEIVING_DELTA;
+    }
+	else 
+	{
+        connection->state = DISCARDING;
+    }
+}
 
-            if (remove(filePath) == 0) 
+// Function to append rebuilt contents to the new file
+int writeOutput(Connection* connection, const unsigned char* data, size_t length) 
+{
+    if (fwrite(data, 1, length, connection->file) != length) 
+	{
+        perror("Error writing file");
+        return 0;
+    }
+    md5Update(&connection->digest, data, length);
+    connection->written += length;
+    return 1;
+}
+
+// Function to copy whole blocks of the old file into the new one
+int copyBlocks(Connection* connection, uint32_t first, uint32_t count) 
+{
+    unsigned char buffer[RECEIVE_SIZE];
+    uint64_t offset = (uint64_t)first * connection->blockSize;
+    uint64_t length = (uint64_t)count * connection->blockSize;
+    if (offset + length > connection->basisSize || fseeko(connection->basis, offset, SEEK_SET) == -1) 
+	{
+        fprintf(stderr, "Delta for %s refers to blocks the server does not have\n", connection->fileName);
+        return 0;
+    }
+
+    while (length > 0) 
+	{
+        size_t take = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (fread(buffer, 1, take, connection->basis) != take) 
+		{
+            perror("Error reading file");
+            return 0;
+        }
+        if (!writeOutput(connection, buffer, take)) 
+		{
+            return 0;
+        }
+        length -= take;
+    }
+    return 1;
+}
+
+// Function to apply delta instructions as they arrive; instructions and literal data may
+// be split anywhere between reads. Returns 0 if the delta cannot be applied.
+int applyDelta(Connection* connection, const unsigned char* data, size_t length) 
+{
+    while (length > 0) 
+	{
+        if (connection->literalRemaining > 0) 
+		{
+            size_t take = connection->literalRemaining < length ? connection->literalRemaining : length;
+            if (!writeOutput(connection, data, take)) 
 			{
-                printf("File deleted: %s\n", filename);
-                writeLog(clientDir, filename);
-            } else 
+                return 0;
+            }
+            connection->literalRemaining -= take;
+            data += take;
+            length -= take;
+            continue;
+        }
+
+        connection->op[connection->opBytes++] = *data++;
+        length--;
+        size_t needed = connection->op[0] == DELTA_COPY ? 9 : connection->op[0] == DELTA_LITERAL ? 5 : 0;
+        if (needed == 0) 
+		{
+            fprintf(stderr, "Bad delta instruction for %s\n", connection->fileName);
+            return 0;
+        }
+        if (connection->opBytes < needed) 
+		{
+            continue;
+        }
+
+        connection->opBytes = 0;
+        if (connection->op[0] == DELTA_LITERAL) 
+		{
+            connection->literalRemaining = getUint32(connection->op + 1);
+        }
+		else if (!copyBlocks(connection, getUint32(connection->op + 1), getUint32(connection->op + 5))) 
+		{
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to check that a delta rebuilt exactly the file the client has
+int deltaComplete(Connection* connection) 
+{
+    unsigned char digest[STRONG_HASH_SIZE];
+    md5Final(&connection->digest, digest);
+    if (connection->opBytes != 0 || connection->literalRemaining != 0 ||
+        connection->written != connection->expectedSize ||
+        memcmp(digest, connection->expectedDigest, STRONG_HASH_SIZE) != 0) 
+	{
+        fprintf(stderr, "Delta for %s does not match the client's file\n", connection->fileName);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to complete an upload once all of its contents arrived
+int finishUpload(Connection* connection) 
+{
+    uint32_t status = STATUS_ERROR;
+    if (connection->basis != NULL) 
+	{
+        fclose(connection->basis);
+        connection->basis = NULL;
+    }
+
+    if (connection->file != NULL) 
+	{
+        char filePath[PATH_MAX];
+        snprintf(filePath, sizeof(filePath), "%s/%s", connection->clientDir, connection->fileName);
+
+        int isDelta = connection->state == RECEIVING_DELTA;
+        int failed = connection->state == DISCARDING || (isDelta && !deltaComplete(connection));
+        if (fclose(connection->file) != 0 || failed || rename(connection->tempPath, filePath) == -1) 
+		{
+            if (!failed) 
 			{
-                perror("Error deleting file");
+                perror("Error storing file");   // other failures were reported as they happened
             }
-        } 
-		else if (strcmp(operation, "update") == 0) 
+            unlink(connection->tempPath);
+        }
+		else if (isDelta) 
 		{
-            // Currently, updating a file means deleting the old file and uploading the new one
-            char filePath[1200];
-            sprintf(filePath, "%s/%s", clientDir, filename);
+            status = STATUS_OK;
+            uint64_t sent = connection->frame.length;
+            printf("File updated: %s (%llu of %llu bytes sent, %.1f%% saved)\n", connection->fileName,
+                   (unsigned long long)sent, (unsigned long long)connection->written,
+                   connection->written > sent ? 100.0 * (connection->written - sent) / connection->written : 0.0);
+            writeLog(connection->clientDir, connection->fileName);
+        }
+		else 
+		{
+            status = STATUS_OK;
+            printf("File uploaded: %s\n", connection->fileName);
+            writeLog(connection->clientDir, connection->fileName);
+        }
+        connection->file = NULL;
+    }
 
-            if (remove(filePath) == 0) 
+    connection->state = READING_HEADER;
+    return sendStatus(connection, connection->frame.requestId, status, NULL, 0) == 0;
+}
+
+// Function to carry out a request whose payload has been buffered. Returns 0 if the
+// connection must be closed.
+int handleRequest(Connection* connection) 
+{
+    FrameHeader* frame = &connection->frame;
+    char* name = (char*)connection->payload;
+    size_t nameLength = connection->payloadNeeded;
+    uint32_t status = STATUS_OK;
+
+    if (frame->type == FRAME_MANIFEST) 
+	{
+        // The payload is a manifest, not a name
+        int result = exchangeManifests(connection, frame->requestId);
+        free(connection->payload);
+        connection->payload = NULL;
+        connection->state = READING_HEADER;
+        return result == 0;
+    }
+
+    if (frame->type == FRAME_UPLOAD || frame->type == FRAME_DELTA) 
+	{
+        nameLength = getUint16(connection->payload);
+        if (connection->payloadNeeded == 2) 
+		{
+            // Name length known: buffer the name (and delta header), then stream the contents
+            connection->payloadNeeded = 2 + nameLength + (frame->type == FRAME_DELTA ? DELTA_HEADER_SIZE : 0);
+            if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || connection->payloadNeeded > frame->length) 
 			{
-                FILE* file = fopen(filename, "wb");
-                if (file == NULL) 
-				{
-                    perror("Error opening file");
-                    continue;
-                }
+                sendStatus(connection, frame->requestId, STATUS_BAD_REQUEST, NULL, 0);
+                return 0;
+            }
+            return 1;
+        }
+        name += 2;
+    }
+    unsigned char* parameters = (unsigned char*)name + nameLength;  // delta header, read before the name is cut
+    unsigned char deltaHeader[DELTA_HEADER_SIZE];
+    if (frame->type == FRAME_DELTA) 
+	{
+        memcpy(deltaHeader, parameters, DELTA_HEADER_SIZE);
+    }
+    name[nameLength] = '\0';
+
+    // Everything but the greeting names a file in the client's directory
+    int valid = frame->type == FRAME_HELLO ? connection->clientName[0] == '\0' && isSafeName(name) &&
+                                             strchr(name, '/') == NULL
+                                           : connection->clientName[0] != '\0' && isSafeName(name) &&
+                                             !isTempName(strrchr(name, '/') ? strrchr(name, '/') + 1 : name);
+    if (!valid) 
+	{
+        fprintf(stderr, "Bad request from %s\n", connection->clientName[0] ? connection->clientName : "new client");
+        sendStatus(connection, frame->requestId, STATUS_BAD_REQUEST, NULL, 0);
+        return 0;
+    }
+
+    char filePath[PATH_MAX];
+    snprintf(filePath, sizeof(filePath), "%s/%s", connection->clientDir, name);
+    int result = 0;
 
-                while ((numBytes = recv(clientSocket, buffer, sizeof(buffer), 0)) > 0) 
+    if (frame->type == FRAME_HELLO) 
+	{
+        // Receive client directory name
+        snprintf(connection->clientName, sizeof(connection->clientName), "%s", name);
+        snprintf(connection->clientDir, sizeof(connection->clientDir), "%s/%s", directory, name);
+        if (mkdir(connection->clientDir, 0755) == -1 && errno != EEXIST) 
+		{
+            perror("Error creating client directory");
+        }
+        printf("Client connected: %s\n", connection->clientName);
+        result = sendStatus(connection, frame->requestId, STATUS_OK, NULL, 0);
+    }
+	else if (frame->type == FRAME_UPLOAD || frame->type == FRAME_DELTA) 
+	{
+        if (frame->type == FRAME_DELTA) 
+		{
+            beginDelta(connection, name, deltaHeader);
+        }
+		else 
+		{
+            beginUpload(connection, name);
+        }
+        connection->remaining = frame->length - connection->payloadNeeded;
+        free(connection->payload);
+        connection->payload = NULL;
+        return 1;
+    }
+	else if (frame->type == FRAME_DELETE) 
+	{
+        if (remove(filePath) == 0) 
+		{
+            printf("File deleted: %s\n", name);
+            writeLog(connection->clientDir, name);
+        }
+		else 
+		{
+            status = errno == ENOENT ? STATUS_NOT_FOUND : STATUS_ERROR;
+            if (status == STATUS_ERROR) 
+			{
+                perror("Error deleting file");
+            }
+        }
+        result = sendStatus(connection, frame->requestId, status, NULL, 0);
+    }
+	else if (frame->type == FRAME_SIGNATURE) 
+	{
+        result = sendSignature(connection, frame->requestId, filePath);
+    }
+	else if (frame->type == FRAME_DOWNLOAD) 
+	{
+        result = sendDownload(connection, frame->requestId, filePath);
+    }
+	else if (frame->type == FRAME_CHECK) 
+	{
+        struct stat fileStat;
+        unsigned char info[16];
+        if (stat(filePath, &fileStat) == 0) 
+		{
+            putUint64(info, (uint64_t)fileStat.st_mtime);
+            putUint64(info + 8, (uint64_t)fileStat.st_size);
+            result = sendStatus(connection, frame->requestId, STATUS_OK, info, sizeof(info));
+        }
+		else 
+		{
+            result = sendStatus(connection, frame->requestId, STATUS_NOT_FOUND, NULL, 0);
+        }
+    }
+	else 
+	{
+        sendStatus(connection, frame->requestId, STATUS_BAD_REQUEST, NULL, 0);
+        return 0;
+    }
+
+    free(connection->payload);
+    connection->payload = NULL;
+    connection->state = READING_HEADER;
+    return result == 0;
+}
+
+// Function to start on a frame once its header has arrived
+int beginRequest(Connection* connection) 
+{
+    FrameHeader* frame = &connection->frame;
+    decodeFrameHeader(connection->header, frame);
+    connection->headerBytes = 0;
+
+    if (frame->version != PROTOCOL_VERSION) 
+	{
+        fprintf(stderr, "Client speaks protocol version %d, expected %d\n", frame->version, PROTOCOL_VERSION);
+        sendStatus(connection, frame->requestId, STATUS_BAD_VERSION, NULL, 0);
+        return 0;
+    }
+
+    // Uploads and deltas buffer only their name and header; the rest buffer their whole payload
+    size_t capacity;
+    int streamed = frame->type == FRAME_UPLOAD || frame->type == FRAME_DELTA;
+    if (streamed) 
+	{
+        connection->payloadNeeded = 2;
+        capacity = 2 + MAX_NAME_LENGTH + DELTA_HEADER_SIZE + 1;
+    }
+	else 
+	{
+        connection->payloadNeeded = frame->length;
+        capacity = frame->length + 1;
+    }
+    uint64_t limit = streamed ? UINT64_MAX : frame->type == FRAME_MANIFEST ? MAX_MANIFEST_SIZE : MAX_REQUEST_PAYLOAD;
+    if (frame->length > limit ||
+        frame->length < connection->payloadNeeded) 
+	{
+        sendStatus(connection, frame->requestId, STATUS_BAD_REQUEST, NULL, 0);
+        return 0;
+    }
+
+    connection->payload = malloc(capacity);
+    connection->payloadBytes = 0;
+    connection->state = READING_PAYLOAD;
+    return 1;
+}
+
+// Function to feed bytes received from a client through the frame parser. Frames may
+// arrive split across reads or several to a read; requests are answered in order.
+// Returns 0 if the connection must be closed.
+int consumeInput(Connection* connection, const unsigned char* data, size_t length) 
+{
+    while (1) 
+	{
+        if (connection->state == READING_HEADER) 
+		{
+            if (length == 0) 
+			{
+                return 1;
+            }
+            size_t take = FRAME_HEADER_SIZE - connection->headerBytes;
+            take = take < length ? take : length;
+            memcpy(connection->header + connection->headerBytes, data, take);
+            connection->headerBytes += take;
+            data += take;
+            length -= take;
+            if (connection->headerBytes == FRAME_HEADER_SIZE && !beginRequest(connection)) 
+			{
+                return 0;
+            }
+        }
+		else if (connection->state == READING_PAYLOAD) 
+		{
+            size_t take = connection->payloadNeeded - connection->payloadBytes;
+            take = take < length ? take : length;
+            memcpy(connection->payload + connection->payloadBytes, data, take);
+            connection->payloadBytes += take;
+            data += take;
+            length -= take;
+            if (connection->payloadBytes < connection->payloadNeeded) 
+			{
+                return 1;
+            }
+            if (!handleRequest(connection)) 
+			{
+                return 0;
+            }
+        }
+		else 
+		{
+            // Upload contents go straight to the file, delta instructions are applied as they come
+            if (connection->remaining == 0) 
+			{
+                if (!finishUpload(connection)) 
 				{
-                    fwrite(buffer, 1, numBytes, file);
+                    return 0;
                 }
+                continue;
+            }
+            if (length == 0) 
+			{
+                return 1;
+            }
+            size_t take = connection->remaining < length ? connection->remaining : length;
+            if (connection->state == RECEIVING_FILE && fwrite(data, 1, take, connection->file) != take) 
+			{
+                perror("Error writing file");
+                connection->state = DISCARDING;
+            }
+			else if (connection->state == RECEIVING_DELTA && !applyDelta(connection, data, take)) 
+			{
+                connection->state = DISCARDING;
+            }
+            data += take;
+            length -= take;
+            connection->remaining -= take;
+        }
+    }
+}
 
-                fclose(file);
-                printf("File updated: %s\n", filename);
-                writeLog(clientDir, filename);
-            } 
-			else 
+// Function to read everything a client has sent so far. Edge-triggered epoll reports
+// new input only once, so the socket is read until it would block. Returns 0 when the
+// connection is finished.
+int serviceConnection(Connection* connection, unsigned char* buffer) 
+{
+    for (int reads = 0; reads < READS_PER_EVENT; reads++) 
+	{
+        // Further requests wait until the client has taken enough of its replies
+        if (outputBacklogged(connection)) 
+		{
+            return 1;
+        }
+        ssize_t numBytes = recv(connection->socket, buffer, RECEIVE_SIZE, 0);
+        if (numBytes > 0) 
+		{
+            if (!consumeInput(connection, buffer, numBytes)) 
 			{
-                perror("Error updating file");
+                return 0;
             }
+            continue;
         }
+        if (numBytes == -1 && errno == EINTR) 
+		{
+            continue;
+        }
+        if (numBytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) 
+		{
+            return 1;
+        }
+        if (numBytes == -1) 
+		{
+            perror("Error receiving from client");
+        }
+        return 0;
     }
 
-    printf("Client disconnected: %s\n", buffer);
-  
-    
+    // Still more to read: re-arming puts the client behind the others that are waiting
+    return 1;
+}
+
+// Function to close a client connection. An upload cut off by it is dropped; replies
+// that fit in the socket, such as the one rejecting a bad request, still go out.
+void closeConnection(Connection* connection) 
+{
+    flushOutput(connection);
+    while (connection->outputHead != NULL) 
+	{
+        Output* output = connection->outputHead;
+        connection->outputHead = output->next;
+        freeOutput(output);
+    }
+    if (connection->basis != NULL) 
+	{
+        fclose(connection->basis);
+    }
+    if (connection->file != NULL) 
+	{
+        fclose(connection->file);
+        unlink(connection->tempPath);
+        printf("Upload interrupted: %s\n", connection->fileName);
+    }
+    free(connection->payload);
+
+    printf("Client disconnected: %s\n", connection->clientName);
+
+    pthread_mutex_lock(&client_mutex);
+    num_clients--;
+    if (connection->livePrevious != NULL) 
+	{
+        connection->livePrevious->liveNext = connection->liveNext;
+    }
+	else 
+	{
+        liveConnections = connection->liveNext;
+    }
+    if (connection->liveNext != NULL) 
+	{
+        connection->liveNext->livePrevious = connection->livePrevious;
+    }
     pthread_mutex_unlock(&client_mutex);
-    close(clientSocket);
-    free(arg);
+
+    close(connection->socket);
+    free(connection);
+}
+
+// Function to serve clients with pending input until the server stops
+void* workerThread(void* arg) 
+{
+    unsigned char buffer[RECEIVE_SIZE];
+
+    Connection* connection;
+    while ((connection = popConnection()) != NULL) 
+	{
+        if (!serviceConnection(connection, buffer) || flushOutput(connection) == -1) 
+		{
+            closeConnection(connection);
+            continue;
+        }
+
+        // Hand the socket back to the reactor: for its next input, unless its replies are
+        // backed up, and for room to send the replies still queued
+        struct epoll_event event;
+        event.events = EPOLLRDHUP | EPOLLET | EPOLLONESHOT | (outputBacklogged(connection) ? 0 : EPOLLIN) |
+                       (connection->outputHead != NULL ? EPOLLOUT : 0);
+        event.data.ptr = connection;
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->socket, &event) == -1) 
+		{
+            perror("Error re-arming client socket");
+            closeConnection(connection);
+        }
+    }
+
     return NULL;
 }
 
+// Function to accept every pending connection and register it with the reactor
+void acceptClients() 
+{
+    while (1) 
+	{
+        // Accept client connection
+        struct sockaddr_in clientAddress;
+        socklen_t clientAddressLength = sizeof(clientAddress);
+        int clientSocket = accept4(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLength,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (clientSocket == -1) 
+		{
+            if (errno == EINTR) 
+			{
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) 
+			{
+                perror("Error accepting client connection");
+            }
+            return;
+        }
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        connection->socket = clientSocket;
+        connection->state = READING_HEADER;
+
+        // One-shot: a ready client is handed to exactly one worker at a time
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1) 
+		{
+            perror("Error registering client socket");
+            close(clientSocket);
+            free(connection);
+            continue;
+        }
+
+        pthread_mutex_lock(&client_mutex);
+        num_clients++;
+        connection->liveNext = liveConnections;
+        if (liveConnections != NULL) 
+		{
+            liveConnections->livePrevious = connection;
+        }
+        liveConnections = connection;
+        pthread_mutex_unlock(&client_mutex);
+
+        // Print client connection information
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(clientAddress.sin_addr), client_ip, INET_ADDRSTRLEN);
+        printf("Client connected: %s:%d\n", client_ip, ntohs(clientAddress.sin_port));
+    }
+}
+
 // Signal handler for SIGINT
 void handleSIGINT(int signum) 
 {
-    printf("\nTerminating server...\n");
-    
- 	// Close the server socket
-    close(serverSocket);
-
-    // Wait for all client threads to finish
-    pthread_mutex_lock(&logMutex);
-    printf("Waiting for all client threads to finish...\n");
-    pthread_mutex_unlock(&logMutex);
+    const char message[] = "\nTerminating server...\n";
+    if (write(STDOUT_FILENO, message, sizeof(message) - 1) == -1) 
+	{
+        // Nothing more to do from a signal handler
+    }
 
-    pthread_exit(NULL);
-    exit(EXIT_SUCCESS);
+    // epoll_wait returns with EINTR and the reactor loop ends
+    running = 0;
 }
 
 int main(int argc, char* argv[]) 
@@ -216,14 +1130,23 @@ int main(int argc, char* argv[])
     threadPoolSize = atoi(argv[2]);
     int portNumber = atoi(argv[3]);
 
+    if (threadPoolSize < 1) 
+	{
+        fprintf(stderr, "Invalid threadPoolSize: %s\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
     // Create server socket
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (serverSocket == -1) 
 	{
         perror("Error creating socket");
         exit(EXIT_FAILURE);
     }
 
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     struct sockaddr_in serverAddress;
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = INADDR_ANY;
@@ -237,12 +1160,29 @@ int main(int argc, char* argv[])
     }
 
     // Listen for client connections
-    if (listen(serverSocket, MAX_CLIENTS) == -1) 
+    if (listen(serverSocket, SOMAXCONN) == -1) 
 	{
         perror("Error listening for connections");
         exit(EXIT_FAILURE);
     }
 
+    // The reactor waits on the listening socket and every idle client socket
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) 
+	{
+        perror("Error creating epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event listenEvent;
+    listenEvent.events = EPOLLIN | EPOLLET;
+    listenEvent.data.ptr = NULL;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &listenEvent) == -1) 
+	{
+        perror("Error registering server socket");
+        exit(EXIT_FAILURE);
+    }
+
     printf("Server listening on port %d\n", portNumber);
 
     // Set up signal handler for SIGINT
@@ -251,43 +1191,69 @@ int main(int argc, char* argv[])
     sigemptyset(&sigint_action.sa_mask);
     sigint_action.sa_flags = 0;
     sigaction(SIGINT, &sigint_action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
     // Create thread pool
     pthread_t threadPool[threadPoolSize];
-    int threadIndex = 0;
+    for (int i = 0; i < threadPoolSize; i++) 
+	{
+        if (pthread_create(&threadPool[i], NULL, workerThread, NULL) != 0) 
+		{
+            perror("Error creating thread");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    while (1) 
+    struct epoll_event events[MAX_EVENTS];
+    while (running) 
 	{
-        // Accept client connection
-        struct sockaddr_in clientAddress;
-        socklen_t clientAddressLength = sizeof(clientAddress);
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLength);
-        
-        if (clientSocket == -1) 
+        int numEvents = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (numEvents == -1) 
 		{
-            perror("Error accepting client connection");
+            if (errno != EINTR) 
+			{
+                perror("Error waiting for events");
+                break;
+            }
             continue;
         }
 
-        // Create a new thread to handle the client
-        int* newClientSocket = malloc(sizeof(int));
-        *newClientSocket = clientSocket;
-        if (pthread_create(&threadPool[threadIndex], NULL, handleClient, newClientSocket) != 0) 
+        for (int i = 0; i < numEvents; i++) 
 		{
-            perror("Error creating thread");
-            close(clientSocket);
-            free(newClientSocket);
+            if (events[i].data.ptr == NULL) 
+			{
+                acceptClients();
+            }
+			else 
+			{
+                pushConnection(events[i].data.ptr);
+            }
         }
+    }
 
-        // Increment thread index and wrap around if necessary
-        threadIndex = (threadIndex + 1) % threadPoolSize;
-        
-        // Print client connection information
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(clientAddress.sin_addr), client_ip, INET_ADDRSTRLEN);
-        printf("Client connected: %s:%d\n", client_ip, ntohs(clientAddress.sin_port));
+    // Wait for all worker threads to finish
+    pthread_mutex_lock(&workQueue.mutex);
+    workQueue.stopping = 1;
+    pthread_cond_broadcast(&workQueue.ready);
+    pthread_mutex_unlock(&workQueue.mutex);
+
+    printf("Waiting for all worker threads to finish...\n");
+    for (int i = 0; i < threadPoolSize; i++) 
+	{
+        pthread_join(threadPool[i], NULL);
+    }
+
+    pthread_mutex_lock(&client_mutex);
+    printf("Closing %d client connection(s)\n", num_clients);
+    pthread_mutex_unlock(&client_mutex);
+
+    // The workers are gone, so no other thread touches a connection any more
+    while (liveConnections != NULL) 
+	{
+        closeConnection(liveConnections);
     }
 
+    close(epollFd);
+    close(serverSocket);
     return 0;
 }
-
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,209 +7,4418 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <signal.h>
 #include <limits.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
-#define BUFFER_SIZE 10
+#define MAX_QUEUE_DEPTH 4096          // ring capacity when the queue depth is tuned at runtime
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+#define MIN_BLOCK_SIZE (64 << 10)
+#define MAX_BLOCK_SIZE (8 << 20)
+#define URING_AUTO_BLOCK_SIZE (1 << 20)   // per-slot buffer cap for io_uring in auto mode
+#define TUNE_INTERVAL_MS 500
+#define AUTO_CONSUMERS 2            // consumers an auto pool starts with
+#define MAX_AUTO_CONSUMERS 64
+#define SCALE_INTERVALS 2           // tuner intervals per consumer count decision
+#define SCALE_HOLD 8                // decisions to wait after a step that did not pay off
+#define MAX_TIMELINE 256
+#define FD_RESERVE 32               // descriptors kept out of the budget: stdio, manifest, journal, reports, scans
+#define MIN_FD_BUDGET 8
+#define DIRECT_ALIGN 4096               // offset, length and buffer alignment for O_DIRECT
+#define STREAM_WINDOW (8 << 20)         // bytes between page cache drops in fadvise mode
+#define SYNC_GROUP_MS 100               // longest a finished file waits for its group commit
+#define CRC32C_POLY 0x82F63B78          // Castagnoli, reflected
+#define JOURNAL_MAGIC 0x4a704370u       // "pCpJ", at the start of every journal record
+#define JOURNAL_STEP (64 << 20)         // large files are journaled in ranges of this size
+#define JOURNAL_INTERVAL_MS 1000        // how often completed work is made durable and journaled
+#define MAX_NODES 64
+#define LIST_BUFFER_SIZE (64 << 10)
+
+// Copy backends in the order they are tried; later ones are fallbacks
+typedef enum {
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_READ_WRITE,
+    COPY_METHODS
+} CopyMethod;
+
+const char* copy_method_names[COPY_METHODS] = { "copy_file_range", "sendfile", "splice", "read/write" };
+
+// Returned by a backend that the kernel refused for this pair of files
+#define COPY_UNSUPPORTED 1
+
+// Source and destination directory descriptors shared by the files queued from one
+// directory, so consumers open entries with openat instead of resolving full paths
+typedef struct {
+    atomic_int refs;
+    int source_fd;
+    int destination_fd;
+} DirHandle;
+
+typedef enum {
+    JOB_UNOPENED,
+    JOB_CREATED,                // destination created and truncated by the first range
+    JOB_OPEN_FAILED
+} JobState;
+
+// A file being copied; shared by every work item it was split into. Nothing is held
+// open between items: each consumer opens the file just before copying its range.
+typedef struct FileJob {
+    pthread_mutex_t open_mutex;
+    JobState state;
+    DirHandle* dir;             // NULL when the file must be opened by full path
+    const char* name;           // entry name inside dir
+    off_t size;
+    int chunks;
+    atomic_int chunks_done;
+    atomic_int method;          // slowest backend any range had to use
+    atomic_int failed;
+    struct timespec mtime;      // source modification time, recorded in the manifest
+    atomic_ullong started_ns;   // when the first range began copying
+    int batched;                // carried by a batch item with other small files
+    struct FileJob* batch_next; // next small file carried by the same work item
+    uint64_t hash;              // source content hash, 0 when not computed
+    uint32_t crc;               // CRC32C of the copied data in checksum mode
+    uint32_t* range_crcs;       // per-range CRC32Cs of a chunked file, combined at the end
+    off_t* resume_ranges;       // start/end pairs still to copy when resuming a partial file
+    int resume_count;
+    char source_file[PATH_MAX];
+    char destination_file[PATH_MAX];
+} FileJob;
+
+// Descriptors one consumer holds while copying a range of a file
+typedef struct {
+    FileJob* job;
+    int source_fd;
+    int destination_fd;
+    int source_direct;          // opened with O_DIRECT
+    int destination_direct;
+    uint32_t crc;               // CRC32C of the range so far, holes included
+} OpenFile;
+
+// Small files collected by one producer until a batch limit is reached
+typedef struct {
+    FileJob* head;
+    FileJob* tail;
+    int files;
+    off_t bytes;
+} Batch;
+
+// One unit of work: a byte range of a file
+typedef struct {
+    FileJob* job;
+    off_t offset;
+    off_t length;   // -1 copies until end of file
+} WorkItem;
+
+// Bounded lock-free multi-producer/multi-consumer ring. Each slot carries a sequence
+// number telling producers and consumers whose turn it is, so neither side takes a lock.
+typedef struct {
+    atomic_size_t sequence;
+    WorkItem item;
+} Slot;
+
+typedef struct {
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+    // Futex words bumped on every enqueue / dequeue; sleepers wait for them to change
+    _Alignas(64) atomic_uint not_empty;
+    atomic_int empty_waiters;
+    _Alignas(64) atomic_uint not_full;
+    atomic_int full_waiters;
+    atomic_int done;
+    size_t capacity;
+    atomic_size_t limit;            // producers treat the ring as full at this depth
+    atomic_ullong full_sleeps;      // producer sleeps on a full ring
+    atomic_ullong empty_sleeps;     // consumer sleeps on an empty ring
+    Slot* slots;
+} Buffer;
+
+// A directory still to be scanned and the directory its entries are copied into
+typedef struct {
+    char source_dir[PATH_MAX];
+    char destination_dir[PATH_MAX];
+} ScanTask;
+
+// Per-scanner deque: the owner pushes and pops at the tail, idle scanners steal from the head
+typedef struct {
+    pthread_mutex_t mutex;
+    ScanTask** tasks;
+    int head;
+    int count;
+    int capacity;
+} ScanQueue;
+
+typedef struct {
+    ScanQueue* queues;
+    int count;
+    int pending;        // directories queued or being scanned
+    unsigned long long queued;  // directories ever queued, so a scanner notices one queued while it looked
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+} Scanners;
+
+typedef enum {
+    STATS_NONE,
+    STATS_JSON,
+    STATS_CSV
+} StatsFormat;
+
+// System calls counted per thread for the run report
+typedef enum {
+    CALL_OPEN,
+    CALL_CLOSE,
+    CALL_STAT,
+    CALL_READ,
+    CALL_WRITE,
+    CALL_COPY_FILE_RANGE,
+    CALL_SENDFILE,
+    CALL_SPLICE,
+    CALL_FUTEX_WAIT,
+    CALL_FUTEX_WAKE,
+    CALL_URING_ENTER,
+    CALL_FSYNC,
+    CALL_FALLOCATE,
+    CALL_KINDS
+} CallKind;
+
+const char* call_names[CALL_KINDS] = {
+    "open", "close", "stat", "read", "write", "copy_file_range", "sendfile", "splice",
+    "futex_wait", "futex_wake", "io_uring_enter", "fsync", "fallocate"
+};
+
+// Counters owned by one thread. Only the owner writes them (relaxed stores), so the
+// progress reporter can read them while the copy runs without any locking.
+typedef struct ThreadStats {
+    const char* role;
+    int id;
+    int node;                   // NUMA node the thread was placed on, -1 if not placed
+    atomic_ullong files;
+    atomic_ullong bytes;
+    atomic_ullong wait_ns;      // blocked on the work queue
+    atomic_ullong copy_ns;      // copying ranges
+    atomic_ullong items;        // work items copied
+    atomic_ullong hole_bytes;   // skipped in sparse mode
+    atomic_ullong hash_ns;      // computing checksums of copied data
+    atomic_ullong hashed_bytes;
+    atomic_ullong verify_ns;    // re-reading destinations in --verify mode
+    atomic_ullong last_done_ns; // when this consumer finished its last item
+    atomic_ullong calls[CALL_KINDS];
+    struct ThreadStats* next;
+} ThreadStats;
+
+// File latency histogram: rows are file-size buckets, columns are log2 microsecond buckets
+#define SIZE_BUCKETS 6
+#define LATENCY_BUCKETS 24
+
+const off_t size_bucket_limits[SIZE_BUCKETS] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 256 << 20, -1 };
+
+typedef struct {
+    ThreadStats* threads;       // every registered thread, newest first
+    pthread_mutex_t mutex;
+    atomic_ullong latency[SIZE_BUCKETS][LATENCY_BUCKETS];
+    atomic_ullong batches;
+    atomic_ullong batched_files;
+} Stats;
+
+typedef enum {
+    SCHEDULE_FIFO,      // queue files in directory order
+    SCHEDULE_LARGEST,   // scan everything first, then hand out largest first
+    SCHEDULE_WINDOW     // largest first within a bounded look-ahead window
+} Schedule;
+
+// Files waiting to be handed out, kept as a max-heap on size
+typedef struct {
+    FileJob* job;
+    off_t size;
+    int batch;          // job heads a batch of small files
+} Pending;
+
+typedef struct {
+    Pending* entries;
+    int count;
+    int capacity;
+    pthread_mutex_t mutex;
+} Scheduler;
+
+typedef enum {
+    STREAM_OFF,
+    STREAM_DIRECT,      // O_DIRECT with aligned buffers, fadvise where it is refused
+    STREAM_FADVISE      // buffered I/O, dropping each copied window from the page cache
+} StreamMode;
+
+typedef enum {
+    SYNC_NONE,          // leave write-back to the kernel
+    SYNC_FILE,          // fdatasync each file before reporting it
+    SYNC_GROUP          // a background thread syncs finished files in groups
+} SyncMode;
+
+typedef enum {
+    PLACE_NONE,         // leave consumers to the scheduler
+    PLACE_CPUS,         // pin consumer i to the i-th CPU of --cpus
+    PLACE_SPREAD,       // round-robin consumers over NUMA nodes
+    PLACE_SOURCE,       // all consumers on the node nearest the source device
+    PLACE_DESTINATION   // ... or the destination device
+} Placement;
+
+typedef enum {
+    ENGINE_THREADS,     // producer/consumer threads with blocking copies
+    ENGINE_URING        // one thread driving every copy through io_uring
+} Engine;
 
 typedef struct {
-    int in;
-    int out;
+    off_t chunk_size;   // 0 disables splitting files into byte ranges
+    CopyMethod copy_method;
+    int scanners;
+    Engine engine;
+    int uring_depth;    // copies kept in flight by the io_uring engine
+    int incremental;    // skip files whose size and mtime match the last copy
+    int hash_check;     // also require matching content hashes before skipping
+    const char* manifest_file;
+    StatsFormat stats_format;
+    const char* stats_file;     // NULL writes the report to stdout
+    int progress_interval;      // seconds between progress lines, 0 disables them
+    off_t small_file_size;      // files up to this size are batched
+    off_t batch_bytes;          // a batch is queued once it holds this many bytes...
+    int batch_files;            // ...or this many files; 1 disables batching
+    int sparse;                 // copy only data extents and keep holes
+    Schedule schedule;
+    int schedule_window;        // files held back in SCHEDULE_WINDOW mode
+    int max_fds;                // descriptor budget; 0 derives it from RLIMIT_NOFILE
+    size_t queue_depth;         // from <buffer size>
+    int auto_queue;             // <buffer size> was "auto"
+    size_t block_size;          // bytes per read/write or splice call
+    int auto_block;
+    int auto_consumers;         // <number of consumers> was "auto"
+    StreamMode stream;          // keep bulk copies out of the page cache
+    int preallocate;            // fallocate destinations to their source size
+    SyncMode sync;
+    int sync_group;             // files per group commit in SYNC_GROUP mode
+    int checksum;               // CRC32C every file while it is in the copy buffer
+    int verify;                 // re-read each destination and compare checksums
+    const char* checksum_file;  // write "crc  path" lines here
+    const char* journal_file;   // record completed files and ranges here
+    int resume;                 // skip and continue work recorded in the journal
+    Placement placement;
+    int* cpus;                  // --cpus list, in pinning order
+    int cpu_count;
+    const char* files_from;     // NUL-separated list of files to copy; "-" is stdin
+    int pairs;                  // list entries alternate source and destination paths
+    const char** includes;      // --include globs; a file must match one if any are given
+    int include_count;
+    const char** excludes;      // --exclude globs; matching files and directories are skipped
+    int exclude_count;
+} Options;
+
+// One change of the consumer count in auto mode
+typedef struct {
+    double seconds;             // since the copy started
+    int consumers;
+    double rate;                // MB/s measured before the change
+} ScaleStep;
+
+// Counting semaphore for file descriptors held by open files
+typedef struct {
+    int available;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+} FdBudget;
+
+// Finished files waiting for the group commit thread
+typedef struct SyncEntry {
+    struct SyncEntry* next;
+    char path[];
+} SyncEntry;
+
+typedef struct {
+    SyncEntry* head;
+    SyncEntry** tail;
     int count;
     int done;
+    unsigned long long files;       // synced so far
+    unsigned long long groups;
     pthread_mutex_t mutex;
-    pthread_cond_t not_full;
-    pthread_cond_t not_empty;
-    struct {
-        int source_fd;
-        int destination_fd;
-        char source_file[512];
-        char destination_file[512];
-    } buffer[BUFFER_SIZE];
-} Buffer;
+    pthread_cond_t ready;
+} SyncQueue;
+
+// Journal record header; followed by the path and a CRC32C of header and path, so a
+// record torn by a crash is recognised and everything from it on ignored
+typedef enum {
+    JOURNAL_RANGE = 1,          // [start, end) of the file is copied
+    JOURNAL_FILE = 2            // the whole file is copied
+} JournalType;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t path_length;
+    uint32_t mtime_nsec;
+    int64_t start;
+    int64_t end;
+    int64_t size;               // source size and mtime when the work was done
+    int64_t mtime_sec;
+} JournalRecord;
+
+// Work earlier runs recorded for one file
+typedef struct {
+    char* path;
+    int64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    int complete;
+    off_t* ranges;              // start/end pairs
+    int range_count;
+    size_t record;              // position of its record in the journal, while loading
+} JournalEntry;
+
+// Buffered reader for a NUL-separated path list
+typedef struct {
+    int fd;
+    char* data;
+    size_t start;               // next unread byte
+    size_t end;                 // end of buffered input
+    size_t capacity;
+    int eof;
+} ListReader;
+
+typedef struct {
+    int fd;                     // -1 when not journaling
+    char* pending;              // records not yet written
+    size_t length;
+    size_t capacity;
+    char** sync_paths;          // destination files of the pending records, synced before they are written
+    size_t sync_count;
+    size_t sync_capacity;
+    JournalEntry* entries;      // loaded by --resume, sorted by path
+    size_t count;
+    int done;
+    unsigned long long flushes;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+} Journal;
+
+// What was copied for one file, as stored in the manifest
+typedef struct {
+    char* path;         // relative to the source directory
+    uint64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t hash;
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry* entries;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t mutex;
+} Manifest;
+
+Buffer buf;
+volatile sig_atomic_t done = 0;    // set by SIGINT: stop scanning and copying, keep the journal
+Scanners scanners;
+Options opts = {
+    .scanners = 4,
+    .uring_depth = 64,
+    .small_file_size = 64 << 10,
+    .batch_bytes = 1 << 20,
+    .batch_files = 64,
+    .block_size = DEFAULT_BLOCK_SIZE,
+    .sync_group = 64
+};
+atomic_size_t io_block_size;    // current block size cap; moved by the tuner in auto mode
+atomic_int direct_refused;      // some file system refused O_DIRECT; reported once
+atomic_int active_consumers;    // consumers past this id are parked
+atomic_uint consumer_gate;      // futex word parked consumers sleep on
+ScaleStep timeline[MAX_TIMELINE];       // written by the tuner, read after it exits
+int timeline_count;
+FILE* checksum_out;
+atomic_int verify_failures;
+Manifest previous_manifest;     // loaded at start, sorted by path, read-only afterwards
+Manifest next_manifest;         // filled by consumers and written at exit
+const char* source_root;
+int list_fd = -1;               // --files-from input
+pthread_t list_tid;             // thread reading list_fd, once list_reading is set
+volatile sig_atomic_t list_reading;
+atomic_int skipped_files;
+Stats stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+_Thread_local ThreadStats* my_stats;    // NULL for threads that are not counted
+_Thread_local Batch my_batch;           // small files this producer has not queued yet
+_Thread_local FILE* my_reports;         // collects a batch's report lines; NULL prints them directly
+Scheduler scheduler = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+FdBudget fd_budget = { .mutex = PTHREAD_MUTEX_INITIALIZER, .released = PTHREAD_COND_INITIALIZER };
+atomic_int dir_handles;         // directories currently holding cached descriptors
+int max_dir_handles;
+Journal journal = { .fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+atomic_int resumed_files;       // found complete in the journal
+atomic_int continued_files;     // partly copied, continued from the journal
+SyncQueue sync_queue = { .tail = &sync_queue.head, .mutex = PTHREAD_MUTEX_INITIALIZER,
+                         .ready = PTHREAD_COND_INITIALIZER };
+
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stat_add(atomic_ullong* counter, unsigned long long amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+void count_call(CallKind kind) {
+    if (my_stats != NULL) {
+        stat_add(&my_stats->calls[kind], 1);
+    }
+}
+
+// Give the calling thread its own counters and list them for the report
+ThreadStats* register_thread_stats(const char* role, int id) {
+    ThreadStats* thread = calloc(1, sizeof(ThreadStats));
+    thread->role = role;
+    thread->id = id;
+    thread->node = -1;
+
+    pthread_mutex_lock(&stats.mutex);
+    thread->next = stats.threads;
+    stats.threads = thread;
+    pthread_mutex_unlock(&stats.mutex);
+
+    my_stats = thread;
+    return thread;
+}
+
+unsigned long long load_stat(atomic_ullong* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+unsigned long long total_stat(size_t field_offset) {
+    unsigned long long total = 0;
+    pthread_mutex_lock(&stats.mutex);
+    for (ThreadStats* thread = stats.threads; thread != NULL; thread = thread->next) {
+        total += load_stat((atomic_ullong*)((char*)thread + field_offset));
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    return total;
+}
+
+int size_bucket(off_t size) {
+    int bucket = 0;
+    while (bucket < SIZE_BUCKETS - 1 && size > size_bucket_limits[bucket]) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void record_latency(off_t size, unsigned long long nanoseconds) {
+    int bucket = 0;
+    for (unsigned long long us = nanoseconds / 1000; us > 1 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&stats.latency[size_bucket(size)][bucket], 1, memory_order_relaxed);
+}
+
+// Parse a byte count with an optional K, M or G suffix
+off_t parse_size(const char* text) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || value < 0) {
+        return -1;
+    }
+
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+
+    return *end == '\0' ? (off_t)value : -1;
+}
+
+void init_buffer() {
+    // In auto mode the ring is allocated at its largest and the tuner moves the limit.
+    // The sequence scheme needs at least two slots; a depth of 1 is enforced by the limit.
+    buf.capacity = opts.auto_queue ? MAX_QUEUE_DEPTH : opts.queue_depth < 2 ? 2 : opts.queue_depth;
+    buf.slots = malloc(buf.capacity * sizeof(Slot));
+    for (size_t i = 0; i < buf.capacity; i++) {
+        atomic_init(&buf.slots[i].sequence, i);
+    }
+    atomic_init(&buf.limit, opts.queue_depth);
+    atomic_init(&buf.full_sleeps, 0);
+    atomic_init(&buf.empty_sleeps, 0);
+    atomic_init(&buf.enqueue_pos, 0);
+    atomic_init(&buf.dequeue_pos, 0);
+    atomic_init(&buf.not_empty, 0);
+    atomic_init(&buf.empty_waiters, 0);
+    atomic_init(&buf.not_full, 0);
+    atomic_init(&buf.full_waiters, 0);
+    atomic_init(&buf.done, 0);
+}
+
+void futex_wait(atomic_uint* word, unsigned int expected) {
+    count_call(CALL_FUTEX_WAIT);
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake(atomic_uint* word, int count) {
+    count_call(CALL_FUTEX_WAKE);
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int try_enqueue(const WorkItem* item) {
+    size_t pos = atomic_load_explicit(&buf.enqueue_pos, memory_order_relaxed);
+    while (1) {
+        Slot* slot = &buf.slots[pos % buf.capacity];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (pos - atomic_load(&buf.dequeue_pos) >= atomic_load(&buf.limit)) {
+                return 0;   // over the requested or tuned depth
+            }
+            // Slot is free for this position; claim it
+            if (atomic_compare_exchange_weak_explicit(&buf.enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->item = *item;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;   // full
+        } else {
+            pos = atomic_load_explicit(&buf.enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+int try_dequeue(WorkItem* item) {
+    size_t pos = atomic_load_explicit(&buf.dequeue_pos, memory_order_relaxed);
+    while (1) {
+        Slot* slot = &buf.slots[pos % buf.capacity];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&buf.dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *item = slot->item;
+                // Hand the slot back to producers one lap later
+                atomic_store_explicit(&slot->sequence, pos + buf.capacity, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;   // empty
+        } else {
+            pos = atomic_load_explicit(&buf.dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void enqueue_work(FileJob* job, off_t offset, off_t length) {
+    WorkItem item = { job, offset, length };
+
+    // Sleep on the not_full futex while the ring is full. The word is read before
+    // retrying, so a dequeue racing with us changes it and the wait returns at once.
+    while (!try_enqueue(&item)) {
+        unsigned int seen = atomic_load(&buf.not_full);
+        atomic_fetch_add(&buf.full_waiters, 1);
+        if (!try_enqueue(&item)) {
+            atomic_fetch_add_explicit(&buf.full_sleeps, 1, memory_order_relaxed);
+            futex_wait(&buf.not_full, seen);
+            atomic_fetch_sub(&buf.full_waiters, 1);
+            continue;
+        }
+        atomic_fetch_sub(&buf.full_waiters, 1);
+        break;
+    }
+
+    atomic_fetch_add(&buf.not_empty, 1);
+    if (atomic_load(&buf.empty_waiters) > 0) {
+        futex_wake(&buf.not_empty, 1);
+    }
+}
+
+void notify_not_full() {
+    atomic_fetch_add(&buf.not_full, 1);
+    if (atomic_load(&buf.full_waiters) > 0) {
+        futex_wake(&buf.not_full, 1);
+    }
+}
+
+// Take an item without waiting; returns 0 if the ring is empty
+int try_dequeue_work(WorkItem* item) {
+    if (!try_dequeue(item)) {
+        return 0;
+    }
+    notify_not_full();
+    return 1;
+}
+
+// Wait for the next item; returns 0 once the ring is drained and the producer is done
+int dequeue_work(WorkItem* item) {
+    while (!try_dequeue(item)) {
+        unsigned int seen = atomic_load(&buf.not_empty);
+        atomic_fetch_add(&buf.empty_waiters, 1);
+        if (try_dequeue(item)) {
+            atomic_fetch_sub(&buf.empty_waiters, 1);
+            break;
+        }
+        // Everything was enqueued before done was set, so an empty ring now stays empty
+        if (atomic_load(&buf.done)) {
+            atomic_fetch_sub(&buf.empty_waiters, 1);
+            return 0;
+        }
+        atomic_fetch_add_explicit(&buf.empty_sleeps, 1, memory_order_relaxed);
+        futex_wait(&buf.not_empty, seen);
+        atomic_fetch_sub(&buf.empty_waiters, 1);
+    }
+
+    notify_not_full();
+    return 1;
+}
+
+// Called once every producer has finished; wakes all idle consumers so they can exit
+void finish_producing() {
+    atomic_store(&buf.done, 1);
+    atomic_fetch_add(&buf.not_empty, 1);
+    futex_wake(&buf.not_empty, INT_MAX);
+    atomic_fetch_add(&consumer_gate, 1);
+    futex_wake(&consumer_gate, INT_MAX);
+}
+
+// Park a consumer while its id is past the active count. Returns 0 if the producer
+// finished meanwhile; the active consumers drain what is left.
+int wait_until_active(int id) {
+    while (1) {
+        unsigned int seen = atomic_load(&consumer_gate);
+        if (id < atomic_load(&active_consumers)) {
+            return 1;
+        }
+        if (atomic_load(&buf.done)) {
+            return 0;
+        }
+        futex_wait(&consumer_gate, seen);
+    }
+}
+
+void set_active_consumers(int count) {
+    atomic_store(&active_consumers, count);
+    atomic_fetch_add(&consumer_gate, 1);
+    futex_wake(&consumer_gate, INT_MAX);
+}
+
+// Binary manifest: "PCPM", u32 version, u64 entry count, then per entry
+// u64 size, i64 mtime seconds, u32 mtime nanoseconds, u32 path length,
+// u64 content hash and the path bytes. Fields are in host byte order.
+#define MANIFEST_MAGIC "PCPM"
+#define MANIFEST_VERSION 1
+
+const char* relative_path(const char* source_file) {
+    size_t length = strlen(source_root);
+    // --pairs sources need not lie below the source directory
+    const char* relative = strncmp(source_file, source_root, length) == 0 ? source_file + length : source_file;
+    while (*relative == '/') {
+        relative++;
+    }
+    return relative;
+}
+
+void manifest_add(Manifest* manifest, const char* path, uint64_t size, struct timespec mtime, uint64_t hash) {
+    pthread_mutex_lock(&manifest->mutex);
+    if (manifest->count == manifest->capacity) {
+        manifest->capacity = manifest->capacity ? manifest->capacity * 2 : 1024;
+        manifest->entries = realloc(manifest->entries, manifest->capacity * sizeof(ManifestEntry));
+    }
+    ManifestEntry* entry = &manifest->entries[manifest->count++];
+    entry->path = strdup(path);
+    entry->size = size;
+    entry->mtime_sec = mtime.tv_sec;
+    entry->mtime_nsec = mtime.tv_nsec;
+    entry->hash = hash;
+    pthread_mutex_unlock(&manifest->mutex);
+}
+
+int compare_entries(const void* a, const void* b) {
+    return strcmp(((const ManifestEntry*)a)->path, ((const ManifestEntry*)b)->path);
+}
+
+ManifestEntry* manifest_lookup(Manifest* manifest, const char* path) {
+    ManifestEntry key = { .path = (char*)path };
+    return bsearch(&key, manifest->entries, manifest->count, sizeof(ManifestEntry), compare_entries);
+}
+
+// Load a manifest written by an earlier run; a missing file is simply an empty manifest
+int load_manifest(Manifest* manifest, const char* file) {
+    FILE* in = fopen(file, "rb");
+    if (in == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, MANIFEST_MAGIC, 4) != 0 ||
+        fread(&version, sizeof(version), 1, in) != 1 || version != MANIFEST_VERSION ||
+        fread(&count, sizeof(count), 1, in) != 1) {
+        fclose(in);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t size, hash;
+        int64_t mtime_sec;
+        uint32_t mtime_nsec, length;
+        char path[PATH_MAX];
+        if (fread(&size, sizeof(size), 1, in) != 1 || fread(&mtime_sec, sizeof(mtime_sec), 1, in) != 1 ||
+            fread(&mtime_nsec, sizeof(mtime_nsec), 1, in) != 1 || fread(&length, sizeof(length), 1, in) != 1 ||
+            fread(&hash, sizeof(hash), 1, in) != 1 || length >= sizeof(path) ||
+            fread(path, 1, length, in) != length) {
+            fclose(in);
+            errno = EINVAL;
+            return -1;
+        }
+        path[length] = '\0';
+        struct timespec mtime = { mtime_sec, mtime_nsec };
+        manifest_add(manifest, path, size, mtime, hash);
+    }
+
+    fclose(in);
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compare_entries);
+    return 0;
+}
+
+// Write through a temporary file and rename so a crash never leaves a torn manifest
+int save_manifest(Manifest* manifest, const char* file) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", file);
+
+    FILE* out = fopen(temporary, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+
+    qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), compare_entries);
+
+    uint32_t version = MANIFEST_VERSION;
+    uint64_t count = manifest->count;
+    fwrite(MANIFEST_MAGIC, 1, 4, out);
+    fwrite(&version, sizeof(version), 1, out);
+    fwrite(&count, sizeof(count), 1, out);
+    for (size_t i = 0; i < manifest->count; i++) {
+        ManifestEntry* entry = &manifest->entries[i];
+        uint32_t length = strlen(entry->path);
+        fwrite(&entry->size, sizeof(entry->size), 1, out);
+        fwrite(&entry->mtime_sec, sizeof(entry->mtime_sec), 1, out);
+        fwrite(&entry->mtime_nsec, sizeof(entry->mtime_nsec), 1, out);
+        fwrite(&length, sizeof(length), 1, out);
+        fwrite(&entry->hash, sizeof(entry->hash), 1, out);
+        fwrite(entry->path, 1, length, out);
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) == -1) {
+        fclose(out);
+        return -1;
+    }
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    return rename(temporary, file);
+}
+
+void free_manifest(Manifest* manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+}
+
+// CRC32C, with the SSE4.2 instruction where the CPU has it and a table otherwise.
+// crc32c_update works on the raw register; crc32c() adds the usual pre/post inversion.
+uint32_t crc32c_table[256];
+uint32_t crc32c_x2n[32];        // x^(2^n) mod P, for combining and skipping zeros
+uint32_t (*crc32c_update)(uint32_t, const unsigned char*, size_t);
+const char* crc32c_kernel = "table";
+
+uint32_t crc32c_scalar(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length--) {
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t state = crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)state;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// a * b mod P, polynomials in reflected bit order
+uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t mask = 1u << 31;
+    uint32_t product = 0;
+    while (1) {
+        if (a & mask) {
+            product ^= b;
+            if ((a & (mask - 1)) == 0) {
+                break;
+            }
+        }
+        mask >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * bytes) mod P: the operator that runs the register over that many zero bytes
+uint32_t crc32c_shift(off_t bytes) {
+    uint32_t power = 1u << 31;
+    for (int k = 3; bytes > 0; bytes >>= 1, k++) {
+        if (bytes & 1) {
+            power = crc32c_multiply(crc32c_x2n[k & 31], power);
+        }
+    }
+    return power;
+}
+
+void init_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+    crc32c_x2n[0] = 1u << 30;
+    for (int n = 1; n < 32; n++) {
+        crc32c_x2n[n] = crc32c_multiply(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+    }
+
+    crc32c_update = crc32c_scalar;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_sse42;
+        crc32c_kernel = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    return ~crc32c_update(~crc, data, length);
+}
+
+// CRC of the data followed by that many zero bytes, without touching any zeros
+uint32_t crc32c_zeros(uint32_t crc, off_t bytes) {
+    return ~crc32c_multiply(crc32c_shift(bytes), ~crc);
+}
+
+// CRC of A followed by B, given both CRCs and B's length
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, off_t length_b) {
+    return crc32c_multiply(crc32c_shift(length_b), crc_a) ^ crc_b;
+}
+
+// Hash a block while it sits in the copy buffer, timing it separately from the copy
+void hash_block(uint32_t* crc, const char* data, size_t length) {
+    unsigned long long start = now_ns();
+    *crc = crc32c(*crc, data, length);
+    stat_add(&my_stats->hash_ns, now_ns() - start);
+    stat_add(&my_stats->hashed_bytes, length);
+}
+
+// 64-bit FNV-1a over the file contents; never returns 0, which marks an unknown hash
+uint64_t hash_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            hash = (hash ^ buffer[i]) * 1099511628211ULL;
+        }
+    }
+
+    close(fd);
+    return n == -1 || hash == 0 ? 1 : hash;
+}
+
+int same_mtime(struct timespec a, int64_t sec, uint32_t nsec) {
+    return a.tv_sec == sec && a.tv_nsec == (long)nsec;
+}
+
+// Decide whether an incremental run can leave this file alone. A matching manifest
+// entry is trusted without looking at the destination; otherwise the destination
+// is stat-ed. With --hash-check the contents must match as well.
+int is_unchanged(const char* source_file, const char* destination_file, const struct stat* source, uint64_t* hash) {
+    ManifestEntry* previous = manifest_lookup(&previous_manifest, relative_path(source_file));
+    if (previous != NULL && previous->size == (uint64_t)source->st_size &&
+        same_mtime(source->st_mtim, previous->mtime_sec, previous->mtime_nsec)) {
+        if (!opts.hash_check) {
+            *hash = previous->hash;
+            return 1;
+        }
+        if (previous->hash != 0) {
+            *hash = hash_file(source_file);
+            return *hash == previous->hash;
+        }
+    }
+
+    struct stat destination;
+    count_call(CALL_STAT);
+    if (stat(destination_file, &destination) == -1 || destination.st_size != source->st_size ||
+        !same_mtime(destination.st_mtim, source->st_mtim.tv_sec, source->st_mtim.tv_nsec)) {
+        return 0;
+    }
+    if (!opts.hash_check) {
+        return 1;
+    }
+
+    *hash = hash_file(source_file);
+    return *hash == hash_file(destination_file);
+}
+
+// Give the destination the source's mtime so the next incremental run recognises it
+void preserve_mtime(int destination_fd, struct timespec mtime) {
+    struct timespec times[2] = { { 0, UTIME_OMIT }, mtime };
+    if (futimens(destination_fd, times) == -1) {
+        fprintf(stderr, "Error setting modification time: %s\n", strerror(errno));
+    }
+}
+
+void record_copied(FileJob* job) {
+    if (opts.manifest_file != NULL && !atomic_load(&job->failed)) {
+        manifest_add(&next_manifest, relative_path(job->source_file), job->size, job->mtime, job->hash);
+    }
+}
+
+void acquire_fds(int count) {
+    pthread_mutex_lock(&fd_budget.mutex);
+    while (fd_budget.available < count) {
+        pthread_cond_wait(&fd_budget.released, &fd_budget.mutex);
+    }
+    fd_budget.available -= count;
+    pthread_mutex_unlock(&fd_budget.mutex);
+}
+
+// For a holder that must not block while it has descriptors of its own outstanding
+int try_acquire_fds(int count) {
+    pthread_mutex_lock(&fd_budget.mutex);
+    int acquired = fd_budget.available >= count;
+    if (acquired) {
+        fd_budget.available -= count;
+    }
+    pthread_mutex_unlock(&fd_budget.mutex);
+    return acquired;
+}
+
+void release_fds(int count) {
+    pthread_mutex_lock(&fd_budget.mutex);
+    fd_budget.available += count;
+    pthread_cond_broadcast(&fd_budget.released);
+    pthread_mutex_unlock(&fd_budget.mutex);
+}
+
+// Descriptors this process has open right now
+int count_open_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return 3;
+    }
+    int count = -1;     // the listing's own descriptor
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        count += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    return count;
+}
+
+// Split what the descriptor limit leaves between open files and cached directories.
+// Everything held per consumer (file pairs, splice pipes, io_uring rings and their
+// files) is taken from the budget as it is used, so only a fixed reserve stays back.
+void init_fd_budget(void) {
+    int total = opts.max_fds;
+    if (total == 0) {
+        struct rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        total = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 1 << 20 ? 1 << 20 : (int)limit.rlim_cur;
+        total -= count_open_fds() + FD_RESERVE;
+    }
+    // Below this the limit is nearly used up already; a few files at a time still finish
+    if (total < MIN_FD_BUDGET) {
+        total = MIN_FD_BUDGET;
+    }
+
+    max_dir_handles = total / 8;
+    fd_budget.available = total - max_dir_handles;
+}
+
+// Cache descriptors for a directory being scanned, unless the cache is full
+DirHandle* open_dir_handle(int source_fd, const char* destination_dir) {
+    if (atomic_fetch_add(&dir_handles, 1) >= max_dir_handles) {
+        atomic_fetch_sub(&dir_handles, 1);
+        return NULL;
+    }
+
+    DirHandle* dir = malloc(sizeof(DirHandle));
+    atomic_init(&dir->refs, 1);
+    dir->source_fd = dup(source_fd);
+    dir->destination_fd = open(destination_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->source_fd == -1 || dir->destination_fd == -1) {
+        if (dir->source_fd != -1) {
+            close(dir->source_fd);
+        }
+        free(dir);
+        atomic_fetch_sub(&dir_handles, 1);
+        return NULL;
+    }
+    return dir;
+}
+
+void release_dir_handle(DirHandle* dir) {
+    if (dir == NULL || atomic_fetch_sub(&dir->refs, 1) > 1) {
+        return;
+    }
+    close(dir->source_fd);
+    close(dir->destination_fd);
+    free(dir);
+    atomic_fetch_sub(&dir_handles, 1);
+}
+
+// Reserve the destination's blocks up front so it is laid out in one piece instead of
+// growing a write at a time. KEEP_SIZE leaves the size to the copy, so an interrupted
+// copy still looks short. Sparse copies are not preallocated, it would fill the holes.
+void preallocate(int destination_fd, off_t size) {
+    if (!opts.preallocate || opts.sparse || size <= 0) {
+        return;
+    }
+    count_call(CALL_FALLOCATE);
+    if (fallocate(destination_fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1 && errno != EOPNOTSUPP) {
+        perror("Error preallocating file");
+    }
+}
+
+// Hand a finished file to the group commit thread
+void queue_sync(const char* path) {
+    size_t length = strlen(path) + 1;
+    SyncEntry* entry = malloc(sizeof(SyncEntry) + length);
+    entry->next = NULL;
+    memcpy(entry->path, path, length);
+
+    pthread_mutex_lock(&sync_queue.mutex);
+    *sync_queue.tail = entry;
+    sync_queue.tail = &entry->next;
+    if (++sync_queue.count >= opts.sync_group) {
+        pthread_cond_signal(&sync_queue.ready);
+    }
+    pthread_mutex_unlock(&sync_queue.mutex);
+}
+
+// Open a finished file by path, one descriptor at a time from the budget
+int open_for_sync(const char* path, int flags) {
+    acquire_fds(1);
+    count_call(CALL_OPEN);
+    int fd = open(path, flags | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening %s for sync: %s\n", path, strerror(errno));
+        release_fds(1);
+    }
+    return fd;
+}
+
+void close_for_sync(int fd) {
+    count_call(CALL_CLOSE);
+    close(fd);
+    release_fds(1);
+}
+
+// Sync one group: start write-back on every file first so the device sees the whole
+// group at once, then wait on each, then make the new names durable by syncing each
+// parent directory once
+void commit_group(SyncEntry* group) {
+    for (SyncEntry* entry = group; entry != NULL; entry = entry->next) {
+        int fd = open_for_sync(entry->path, O_RDONLY);
+        if (fd != -1) {
+            sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+            close_for_sync(fd);
+        }
+    }
+
+    char synced_dir[PATH_MAX] = "";
+    while (group != NULL) {
+        SyncEntry* entry = group;
+        group = entry->next;
+
+        int fd = open_for_sync(entry->path, O_RDONLY);
+        if (fd != -1) {
+            count_call(CALL_FSYNC);
+            if (fdatasync(fd) == -1) {
+                fprintf(stderr, "Error syncing file %s: %s\n", entry->path, strerror(errno));
+            }
+            close_for_sync(fd);
+        }
+
+        char* slash = strrchr(entry->path, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+            if (strcmp(entry->path, synced_dir) != 0 && (fd = open_for_sync(entry->path, O_RDONLY | O_DIRECTORY)) != -1) {
+                count_call(CALL_FSYNC);
+                fsync(fd);
+                close_for_sync(fd);
+                snprintf(synced_dir, sizeof(synced_dir), "%s", entry->path);
+            }
+        }
+        free(entry);
+    }
+}
+
+// Group commit thread: sync a group once opts.sync_group files are waiting, or after
+// SYNC_GROUP_MS, and drain whatever is left once the copy is done
+void* sync_thread(void* arg) {
+    (void)arg; // Unused parameter
+    register_thread_stats("syncer", 0);
+
+    pthread_mutex_lock(&sync_queue.mutex);
+    while (!sync_queue.done || sync_queue.count > 0) {
+        if (sync_queue.count < opts.sync_group && !sync_queue.done) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SYNC_GROUP_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&sync_queue.ready, &sync_queue.mutex, &deadline);
+        }
+        if (sync_queue.count == 0) {
+            continue;
+        }
+
+        SyncEntry* group = sync_queue.head;
+        int count = sync_queue.count;
+        sync_queue.head = NULL;
+        sync_queue.tail = &sync_queue.head;
+        sync_queue.count = 0;
+        pthread_mutex_unlock(&sync_queue.mutex);
+
+        commit_group(group);
+
+        pthread_mutex_lock(&sync_queue.mutex);
+        sync_queue.files += count;
+        sync_queue.groups++;
+    }
+    pthread_mutex_unlock(&sync_queue.mutex);
+    return NULL;
+}
+
+// Append a record to the in-memory journal; the journal thread writes it out once the
+// data it describes has been synced
+void journal_append(JournalType type, FileJob* job, off_t start, off_t end) {
+    if (journal.fd == -1) {
+        return;
+    }
+    const char* path = relative_path(job->source_file);
+    JournalRecord record = {
+        .magic = JOURNAL_MAGIC, .type = type, .path_length = strlen(path),
+        .mtime_nsec = job->mtime.tv_nsec, .start = start, .end = end,
+        .size = job->size, .mtime_sec = job->mtime.tv_sec
+    };
+    uint32_t crc = crc32c(crc32c(0, &record, sizeof(record)), path, record.path_length);
+    size_t length = sizeof(record) + record.path_length + sizeof(crc);
+
+    pthread_mutex_lock(&journal.mutex);
+    if (journal.length + length > journal.capacity) {
+        journal.capacity = journal.capacity * 2 > journal.length + length ? journal.capacity * 2 : journal.length + length;
+        journal.pending = realloc(journal.pending, journal.capacity);
+    }
+    memcpy(journal.pending + journal.length, &record, sizeof(record));
+    memcpy(journal.pending + journal.length + sizeof(record), path, record.path_length);
+    memcpy(journal.pending + journal.length + sizeof(record) + record.path_length, &crc, sizeof(crc));
+    journal.length += length;
+    // With --sync=file the consumer has synced the data already
+    if (opts.sync != SYNC_FILE &&
+        (journal.sync_count == 0 || strcmp(journal.sync_paths[journal.sync_count - 1], job->destination_file) != 0)) {
+        if (journal.sync_count == journal.sync_capacity) {
+            journal.sync_capacity = journal.sync_capacity ? journal.sync_capacity * 2 : 64;
+            journal.sync_paths = realloc(journal.sync_paths, journal.sync_capacity * sizeof(char*));
+        }
+        journal.sync_paths[journal.sync_count++] = strdup(job->destination_file);
+    }
+    pthread_mutex_unlock(&journal.mutex);
+}
+
+// Write out the pending records. The files they describe are synced first, so a record
+// never reaches the disk before the data it vouches for; if one cannot be synced, the
+// batch is dropped and the next --resume copies its work again.
+void journal_flush() {
+    pthread_mutex_lock(&journal.mutex);
+    char* records = journal.pending;
+    size_t length = journal.length;
+    char** sync_paths = journal.sync_paths;
+    size_t sync_count = journal.sync_count;
+    journal.pending = NULL;
+    journal.length = 0;
+    journal.capacity = 0;
+    journal.sync_paths = NULL;
+    journal.sync_count = 0;
+    journal.sync_capacity = 0;
+    pthread_mutex_unlock(&journal.mutex);
+
+    int synced = 1;
+    for (size_t i = 0; i < sync_count; i++) {
+        int fd = open(sync_paths[i], O_RDONLY | O_CLOEXEC);
+        count_call(CALL_FSYNC);
+        if (fd == -1 || fdatasync(fd) == -1) {
+            fprintf(stderr, "Error syncing file %s: %s\n", sync_paths[i], strerror(errno));
+            synced = 0;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        free(sync_paths[i]);
+    }
+    free(sync_paths);
+    if (length == 0 || !synced) {
+        free(records);
+        return;
+    }
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(journal.fd, records + written, length - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("Error writing journal");
+            break;
+        }
+        written += n;
+    }
+    count_call(CALL_FSYNC);
+    fdatasync(journal.fd);
+    journal.flushes++;
+    free(records);
+}
+
+void* journal_thread(void* arg) {
+    (void)arg; // Unused parameter
+    register_thread_stats("journal", 0);
+
+    pthread_mutex_lock(&journal.mutex);
+    while (!journal.done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (JOURNAL_INTERVAL_MS % 1000) * 1000000L;
+        deadline.tv_sec += JOURNAL_INTERVAL_MS / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&journal.wake, &journal.mutex, &deadline);
+
+        pthread_mutex_unlock(&journal.mutex);
+        journal_flush();
+        pthread_mutex_lock(&journal.mutex);
+    }
+    pthread_mutex_unlock(&journal.mutex);
+    return NULL;
+}
+
+int compare_journal_entries(const void* a, const void* b) {
+    return strcmp(((const JournalEntry*)a)->path, ((const JournalEntry*)b)->path);
+}
+
+// Orders by path and, for one path, in the order the records were written
+int compare_journal_records(const void* a, const void* b) {
+    const JournalEntry* x = a;
+    const JournalEntry* y = b;
+    int order = strcmp(x->path, y->path);
+    return order != 0 ? order : (x->record > y->record) - (x->record < y->record);
+}
+
+int compare_ranges(const void* a, const void* b) {
+    off_t x = *(const off_t*)a;
+    off_t y = *(const off_t*)b;
+    return (x > y) - (x < y);
+}
+
+JournalEntry* journal_lookup(const char* path) {
+    JournalEntry key = { .path = (char*)path };
+    return bsearch(&key, journal.entries, journal.count, sizeof(JournalEntry), compare_journal_entries);
+}
+
+// Read the valid prefix of a journal and fold its records into one entry per file.
+// Returns the length of that prefix; anything after it is a torn write.
+off_t load_journal(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        return 0;
+    }
+    char* data = malloc(st.st_size);
+    off_t length = 0;
+    while (length < st.st_size) {
+        ssize_t n = pread(fd, data + length, st.st_size - length, length);
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+
+    off_t valid = 0;
+    size_t capacity = 0;
+    while (valid + (off_t)sizeof(JournalRecord) <= length) {
+        JournalRecord record;
+        memcpy(&record, data + valid, sizeof(record));
+        off_t record_length = sizeof(record) + record.path_length + sizeof(uint32_t);
+        uint32_t crc;
+        if (record.magic != JOURNAL_MAGIC || record.path_length >= PATH_MAX || valid + record_length > length) {
+            break;
+        }
+        memcpy(&crc, data + valid + sizeof(record) + record.path_length, sizeof(crc));
+        if (crc != crc32c(0, data + valid, sizeof(record) + record.path_length)) {
+            break;
+        }
+
+        if (journal.count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            journal.entries = realloc(journal.entries, capacity * sizeof(JournalEntry));
+        }
+        JournalEntry* entry = &journal.entries[journal.count++];
+        entry->path = strndup(data + valid + sizeof(record), record.path_length);
+        entry->size = record.size;
+        entry->mtime_sec = record.mtime_sec;
+        entry->mtime_nsec = record.mtime_nsec;
+        entry->complete = record.type == JOURNAL_FILE;
+        entry->ranges = NULL;
+        entry->range_count = 0;
+        entry->record = journal.count - 1;
+        if (record.type == JOURNAL_RANGE) {
+            entry->ranges = malloc(2 * sizeof(off_t));
+            entry->ranges[0] = record.start;
+            entry->ranges[1] = record.end;
+            entry->range_count = 1;
+        }
+        valid += record_length;
+    }
+    free(data);
+
+    // Merge the records of each file. Records describing another version of the
+    // source than the file's last record are dropped.
+    qsort(journal.entries, journal.count, sizeof(JournalEntry), compare_journal_records);
+    size_t merged = 0;
+    for (size_t i = 0; i < journal.count; i++) {
+        JournalEntry* entry = &journal.entries[i];
+        JournalEntry* last = merged > 0 ? &journal.entries[merged - 1] : NULL;
+        if (last == NULL || strcmp(last->path, entry->path) != 0) {
+            journal.entries[merged++] = *entry;
+            continue;
+        }
+        if (last->size != entry->size || last->mtime_sec != entry->mtime_sec || last->mtime_nsec != entry->mtime_nsec) {
+            free(last->ranges);
+            free(last->path);
+            *last = *entry;
+            continue;
+        }
+        last->complete |= entry->complete;
+        if (entry->range_count > 0) {
+            last->ranges = realloc(last->ranges, (last->range_count + 1) * 2 * sizeof(off_t));
+            last->ranges[last->range_count * 2] = entry->ranges[0];
+            last->ranges[last->range_count * 2 + 1] = entry->ranges[1];
+            last->range_count++;
+        }
+        free(entry->ranges);
+        free(entry->path);
+    }
+    journal.count = merged;
+    for (size_t i = 0; i < journal.count; i++) {
+        qsort(journal.entries[i].ranges, journal.entries[i].range_count, 2 * sizeof(off_t), compare_ranges);
+    }
+    return valid;
+}
+
+// Open the journal: fresh for a new copy, or loaded and appended to with --resume
+int open_journal() {
+    journal.fd = open(opts.journal_file, O_RDWR | O_CREAT | O_CLOEXEC | (opts.resume ? 0 : O_TRUNC), 0644);
+    if (journal.fd == -1) {
+        return -1;
+    }
+    if (opts.resume) {
+        off_t valid = load_journal(journal.fd);
+        if (ftruncate(journal.fd, valid) == -1 || lseek(journal.fd, valid, SEEK_SET) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void close_journal() {
+    for (size_t i = 0; i < journal.count; i++) {
+        free(journal.entries[i].path);
+        free(journal.entries[i].ranges);
+    }
+    free(journal.entries);
+    close(journal.fd);
+}
+
+// The byte ranges of a partly copied file that no earlier run recorded, as start/end
+// pairs. Returns their count.
+int missing_ranges(JournalEntry* entry, off_t size, off_t** missing) {
+    *missing = malloc((entry->range_count + 1) * 2 * sizeof(off_t));
+    int count = 0;
+    off_t covered = 0;
+    for (int i = 0; i < entry->range_count; i++) {
+        off_t start = entry->ranges[i * 2];
+        off_t end = entry->ranges[i * 2 + 1];
+        if (start > covered) {
+            (*missing)[count * 2] = covered;
+            (*missing)[count * 2 + 1] = start;
+            count++;
+        }
+        if (end > covered) {
+            covered = end;
+        }
+    }
+    if (covered < size) {
+        (*missing)[count * 2] = covered;
+        (*missing)[count * 2 + 1] = size;
+        count++;
+    }
+    return count;
+}
+
+FileJob* new_job(DirHandle* dir, const char* source_file, const char* destination_file) {
+    FileJob* job = malloc(sizeof(FileJob));
+    pthread_mutex_init(&job->open_mutex, NULL);
+    job->state = JOB_UNOPENED;
+    job->dir = dir;
+    if (dir != NULL) {
+        atomic_fetch_add(&dir->refs, 1);
+    }
+    job->size = 0;
+    job->chunks = 1;
+    atomic_init(&job->chunks_done, 0);
+    atomic_init(&job->method, opts.copy_method);
+    atomic_init(&job->failed, 0);
+    job->mtime.tv_sec = 0;
+    job->mtime.tv_nsec = 0;
+    atomic_init(&job->started_ns, 0);
+    job->batched = 0;
+    job->batch_next = NULL;
+    job->hash = 0;
+    job->crc = 0;
+    job->range_crcs = NULL;
+    job->resume_ranges = NULL;
+    job->resume_count = 0;
+    snprintf(job->source_file, sizeof(job->source_file), "%s", source_file);
+    snprintf(job->destination_file, sizeof(job->destination_file), "%s", destination_file);
+    job->name = strrchr(job->source_file, '/') ? strrchr(job->source_file, '/') + 1 : job->source_file;
+    return job;
+}
+
+void free_job(FileJob* job) {
+    release_dir_handle(job->dir);
+    free(job->range_crcs);
+    free(job->resume_ranges);
+    pthread_mutex_destroy(&job->open_mutex);
+    free(job);
+}
+
+void close_file(OpenFile* file) {
+    if (file->source_fd != -1) {
+        count_call(CALL_CLOSE);
+        close(file->source_fd);
+    }
+    if (file->destination_fd != -1) {
+        count_call(CALL_CLOSE);
+        close(file->destination_fd);
+    }
+    release_fds(2);
+}
+
+int open_entry(FileJob* job, int destination, int flags) {
+    count_call(CALL_OPEN);
+    if (job->dir != NULL) {
+        return openat(destination ? job->dir->destination_fd : job->dir->source_fd, job->name, flags, 0644);
+    }
+    return open(destination ? job->destination_file : job->source_file, flags, 0644);
+}
+
+// In direct streaming mode try O_DIRECT first and fall back to a buffered open where
+// the file system refuses it; *direct tells the caller which one it got
+int open_stream(FileJob* job, int destination, int flags, int* direct) {
+    *direct = 0;
+    if (opts.stream == STREAM_DIRECT) {
+        int fd = open_entry(job, destination, flags | O_DIRECT);
+        if (fd != -1 || errno != EINVAL) {
+            *direct = fd != -1;
+            return fd;
+        }
+        if (!atomic_exchange(&direct_refused, 1)) {
+            fprintf(stderr, "O_DIRECT not supported for %s, falling back to fadvise\n",
+                    destination ? job->destination_file : job->source_file);
+        }
+    }
+
+    int fd = open_entry(job, destination, flags);
+    if (fd != -1 && opts.stream != STREAM_OFF && !destination) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+}
+
+// Open both ends of a file for one range, within the fd budget. The first range to
+// get here creates and truncates the destination; later ones open it as it is.
+// Returns 0 if the file could not be opened.
+int open_file(FileJob* job, OpenFile* file) {
+    file->job = job;
+    file->source_fd = -1;
+    file->destination_fd = -1;
+    file->crc = 0;
+    acquire_fds(2);
+
+    pthread_mutex_lock(&job->open_mutex);
+    if (job->state != JOB_OPEN_FAILED) {
+        file->source_fd = open_stream(job, 0, O_RDONLY | O_CLOEXEC, &file->source_direct);
+        if (file->source_fd == -1) {
+            fprintf(stderr, "Error opening file %s: %s\n", job->source_file, strerror(errno));
+        } else {
+            int truncate = job->state == JOB_UNOPENED ? O_TRUNC : 0;
+            int access = opts.verify ? O_RDWR : O_WRONLY;   // verification reads it back
+            file->destination_fd = open_stream(job, 1, access | O_CREAT | truncate | O_CLOEXEC,
+                                               &file->destination_direct);
+            if (file->destination_fd == -1) {
+                fprintf(stderr, "Error opening file %s: %s\n", job->destination_file, strerror(errno));
+            }
+        }
+
+        if (file->destination_fd != -1) {
+            if (job->state == JOB_UNOPENED) {
+                preallocate(file->destination_fd, job->size);
+            }
+            job->state = JOB_CREATED;
+        } else if (job->state == JOB_UNOPENED) {
+            job->state = JOB_OPEN_FAILED;
+        }
+    }
+    pthread_mutex_unlock(&job->open_mutex);
+
+    if (file->destination_fd == -1) {
+        close_file(file);
+        atomic_store(&job->failed, 1);
+        return 0;
+    }
+    return 1;
+}
+
+void dispatch_job(FileJob* job);
+
+void heap_swap(int a, int b) {
+    Pending entry = scheduler.entries[a];
+    scheduler.entries[a] = scheduler.entries[b];
+    scheduler.entries[b] = entry;
+}
+
+// Remove the largest pending entry; the scheduler mutex must be held
+Pending heap_pop() {
+    Pending top = scheduler.entries[0];
+    scheduler.entries[0] = scheduler.entries[--scheduler.count];
+
+    int i = 0;
+    while (1) {
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < scheduler.count && scheduler.entries[left].size > scheduler.entries[largest].size) {
+            largest = left;
+        }
+        if (right < scheduler.count && scheduler.entries[right].size > scheduler.entries[largest].size) {
+            largest = right;
+        }
+        if (largest == i) {
+            break;
+        }
+        heap_swap(i, largest);
+        i = largest;
+    }
+    return top;
+}
+
+void dispatch_pending(Pending entry) {
+    if (entry.batch) {
+        enqueue_work(entry.job, 0, -1);
+    } else {
+        dispatch_job(entry.job);
+    }
+}
+
+// Hold a file (or batch) back so larger ones can be handed out first. In window mode
+// the largest entry is released as soon as the window overflows.
+void schedule_pending(FileJob* job, off_t size, int batch) {
+    Pending entry = { job, size, batch };
+    if (opts.schedule == SCHEDULE_FIFO) {
+        dispatch_pending(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&scheduler.mutex);
+    if (scheduler.count == scheduler.capacity) {
+        scheduler.capacity = scheduler.capacity ? scheduler.capacity * 2 : 1024;
+        scheduler.entries = realloc(scheduler.entries, scheduler.capacity * sizeof(Pending));
+    }
+
+    int i = scheduler.count++;
+    scheduler.entries[i] = entry;
+    while (i > 0 && scheduler.entries[(i - 1) / 2].size < scheduler.entries[i].size) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    int release = opts.schedule == SCHEDULE_WINDOW && scheduler.count > opts.schedule_window;
+    if (release) {
+        entry = heap_pop();
+    }
+    pthread_mutex_unlock(&scheduler.mutex);
+
+    // Dispatch outside the lock: it may block on a full queue
+    if (release) {
+        dispatch_pending(entry);
+    }
+}
+
+// Hand out everything still held back, largest first, once scanning is over
+void drain_scheduler() {
+    while (1) {
+        pthread_mutex_lock(&scheduler.mutex);
+        if (scheduler.count == 0) {
+            pthread_mutex_unlock(&scheduler.mutex);
+            break;
+        }
+        Pending entry = heap_pop();
+        pthread_mutex_unlock(&scheduler.mutex);
+
+        dispatch_pending(entry);
+    }
+
+    free(scheduler.entries);
+    scheduler.entries = NULL;
+    scheduler.capacity = 0;
+}
+
+// Queue this producer's pending small files as one work item
+void flush_batch() {
+    if (my_batch.head == NULL) {
+        return;
+    }
+
+    atomic_fetch_add(&stats.batches, 1);
+    atomic_fetch_add(&stats.batched_files, my_batch.files);
+
+    Batch batch = my_batch;
+    memset(&my_batch, 0, sizeof(my_batch));
+    schedule_pending(batch.head, batch.bytes, 1);
+}
+
+void add_to_batch(FileJob* job) {
+    if (my_batch.tail == NULL) {
+        my_batch.head = job;
+    } else {
+        my_batch.tail->batch_next = job;
+    }
+    my_batch.tail = job;
+    my_batch.files++;
+    my_batch.bytes += job->size;
+
+    if (my_batch.files >= opts.batch_files || my_batch.bytes >= opts.batch_bytes) {
+        flush_batch();
+    }
+}
+
+int batching_enabled() {
+    return opts.batch_files > 1 && opts.engine == ENGINE_THREADS;
+}
+
+// Look a file up in the journal of earlier runs. Returns 1 if it was copied completely
+// and its destination is still there at full size. A partly copied file gets the
+// ranges still missing; it is started over if its source changed since, or if its
+// destination is gone. Checksums cover whole files and the io_uring engine copies
+// whole files, so those modes start partial files over as well.
+int resume_file(DirHandle* dir, const char* source_file, const char* destination_file, struct stat* source,
+                off_t** missing, int* missing_count) {
+    JournalEntry* entry = journal_lookup(relative_path(source_file));
+    if (entry == NULL || entry->size != source->st_size || entry->mtime_sec != source->st_mtim.tv_sec ||
+        entry->mtime_nsec != (uint32_t)source->st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    struct stat destination;
+    const char* name = strrchr(destination_file, '/') ? strrchr(destination_file, '/') + 1 : destination_file;
+    count_call(CALL_STAT);
+    if ((dir != NULL ? fstatat(dir->destination_fd, name, &destination, 0) : stat(destination_file, &destination)) == -1) {
+        return 0;
+    }
+
+    if (entry->complete) {
+        if (destination.st_size != source->st_size) {
+            return 0;
+        }
+        atomic_fetch_add(&resumed_files, 1);
+        return 1;
+    }
+    if (entry->range_count > 0 && !opts.checksum && opts.engine != ENGINE_URING) {
+        *missing_count = missing_ranges(entry, source->st_size, missing);
+        atomic_fetch_add(&continued_files, 1);
+    }
+    return 0;
+}
+
+// Queue a file for copying. Nothing is opened here; dir (may be NULL) lets the consumer
+// open the file relative to its cached directory descriptors.
+void produce_file_descriptor_pair(DirHandle* dir, const char* source_file, const char* destination_file) {
+    uint64_t hash = 0;
+    struct stat source;
+    int need_stat = opts.incremental || opts.manifest_file != NULL || batching_enabled() ||
+                    opts.schedule != SCHEDULE_FIFO || opts.chunk_size > 0 || opts.preallocate ||
+                    journal.fd != -1;
+    if (need_stat) {
+        count_call(CALL_STAT);
+    }
+    const char* name = strrchr(source_file, '/') ? strrchr(source_file, '/') + 1 : source_file;
+    if (need_stat && (dir != NULL ? fstatat(dir->source_fd, name, &source, 0) : stat(source_file, &source)) == -1) {
+        fprintf(stderr, "Error reading file status %s: %s\n", source_file, strerror(errno));
+        return;
+    }
+
+    if (opts.incremental) {
+        if (is_unchanged(source_file, destination_file, &source, &hash)) {
+            if (opts.manifest_file != NULL) {
+                manifest_add(&next_manifest, relative_path(source_file), source.st_size, source.st_mtim, hash);
+            }
+            atomic_fetch_add(&skipped_files, 1);
+            return;
+        }
+    }
+
+    off_t* missing = NULL;
+    int missing_count = 0;
+    if (opts.resume && resume_file(dir, source_file, destination_file, &source, &missing, &missing_count)) {
+        if (opts.manifest_file != NULL) {
+            manifest_add(&next_manifest, relative_path(source_file), source.st_size, source.st_mtim, hash);
+        }
+        return;
+    }
+
+    // Small files travel in batches; the consumer opens them just before copying
+    if (missing == NULL && batching_enabled() && S_ISREG(source.st_mode) && source.st_size <= opts.small_file_size) {
+        FileJob* job = new_job(dir, source_file, destination_file);
+        job->size = source.st_size;
+        job->mtime = source.st_mtim;
+        job->hash = hash;
+        job->batched = 1;
+        add_to_batch(job);
+        return;
+    }
+
+    FileJob* job = new_job(dir, source_file, destination_file);
+    if (need_stat) {
+        job->size = source.st_size;
+        job->mtime = source.st_mtim;
+    }
+    job->hash = hash;
+    if (missing != NULL) {
+        // Keep what earlier runs copied: open the destination without truncating it
+        job->state = JOB_CREATED;
+        job->resume_ranges = missing;
+        job->resume_count = missing_count;
+    }
+    schedule_pending(job, job->size, 0);
+}
+
+// Queue the work items of a file
+void dispatch_job(FileJob* job) {
+    // A resumed file only copies what the journal does not vouch for
+    if (job->resume_ranges != NULL) {
+        // Count every item before queueing any, so no early finisher sees a partial count
+        job->chunks = 0;
+        for (int i = 0; i < job->resume_count; i++) {
+            off_t length = job->resume_ranges[i * 2 + 1] - job->resume_ranges[i * 2];
+            job->chunks += opts.chunk_size > 0 ? (int)((length + opts.chunk_size - 1) / opts.chunk_size) : 1;
+        }
+        for (int i = 0; i < job->resume_count; i++) {
+            off_t end = job->resume_ranges[i * 2 + 1];
+            for (off_t offset = job->resume_ranges[i * 2]; offset < end; ) {
+                off_t length = end - offset;
+                if (opts.chunk_size > 0 && length > opts.chunk_size) {
+                    length = opts.chunk_size;
+                }
+                enqueue_work(job, offset, length);
+                offset += length;
+            }
+        }
+        if (job->chunks == 0) {
+            // Every range was journaled but the file was not: just finish it
+            job->chunks = 1;
+            enqueue_work(job, job->size, 0);
+        }
+        return;
+    }
+
+    // Small files are copied as a single item that reads until end of file. The io_uring
+    // engine always copies a file as one item.
+    if (opts.chunk_size == 0 || job->size <= opts.chunk_size || opts.engine == ENGINE_URING) {
+        enqueue_work(job, 0, -1);
+        return;
+    }
+
+    // Split large files into byte ranges so several consumers can copy them at once
+    job->chunks = (int)((job->size + opts.chunk_size - 1) / opts.chunk_size);
+    if (opts.checksum) {
+        job->range_crcs = calloc(job->chunks, sizeof(uint32_t));
+    }
+    for (off_t offset = 0; offset < job->size; offset += opts.chunk_size) {
+        off_t length = job->size - offset;
+        if (length > opts.chunk_size) {
+            length = opts.chunk_size;
+        }
+        enqueue_work(job, offset, length);
+    }
+}
+
+int is_unsupported(int error) {
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP;
+}
+
+// Bytes left in a range, capped to one call; length -1 means until end of file
+size_t range_step(off_t offset, off_t end, size_t cap) {
+    if (end >= 0 && (off_t)cap > end - offset) {
+        return (size_t)(end - offset);
+    }
+    return cap;
+}
+
+// Block size for the first call on a range. In auto mode a range starts small so tiny
+// files stay cheap, and next_block doubles it while the range keeps streaming.
+size_t first_block() {
+    size_t cap = atomic_load_explicit(&io_block_size, memory_order_relaxed);
+    return opts.auto_block && cap > MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : cap;
+}
+
+size_t next_block(size_t block, ssize_t transferred) {
+    size_t cap = atomic_load_explicit(&io_block_size, memory_order_relaxed);
+    if ((size_t)transferred == block && block < cap) {
+        block *= 2;
+    }
+    return block > cap ? cap : block;
+}
+
+// Size of the per-consumer bounce buffer: the largest block any call may use
+size_t copy_buffer_size() {
+    return opts.auto_block ? MAX_BLOCK_SIZE : opts.block_size;
+}
+
+int copy_with_copy_file_range(OpenFile* file, off_t* offset, off_t end) {
+    while (end < 0 || *offset < end) {
+        loff_t in = *offset;
+        loff_t out = *offset;
+        count_call(CALL_COPY_FILE_RANGE);
+        ssize_t n = copy_file_range(file->source_fd, &in, file->destination_fd, &out,
+                                    range_step(*offset, end, 1 << 30), 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return is_unsupported(errno) ? COPY_UNSUPPORTED : -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        *offset += n;
+    }
+    return 0;
+}
+
+int copy_with_sendfile(OpenFile* file, off_t* offset, off_t end) {
+    // sendfile writes at the destination file position; this descriptor is ours alone
+    if (lseek(file->destination_fd, *offset, SEEK_SET) == -1) {
+        return -1;
+    }
+
+    while (end < 0 || *offset < end) {
+        count_call(CALL_SENDFILE);
+        ssize_t n = sendfile(file->destination_fd, file->source_fd, offset, range_step(*offset, end, 1 << 30));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return is_unsupported(errno) ? COPY_UNSUPPORTED : -1;
+        }
+        if (n == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Write out whatever is left in the pipe after the destination side refused splice
+int drain_pipe(int pipe_fd, int destination_fd, off_t* out, size_t pending) {
+    char buffer[4096];
+    while (pending > 0) {
+        ssize_t n = read(pipe_fd, buffer, pending < sizeof(buffer) ? pending : sizeof(buffer));
+        if (n <= 0) {
+            return -1;
+        }
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = pwrite(destination_fd, buffer + written, n - written, *out + written);
+            if (w == -1 && errno == EINTR) {
+                continue;
+            }
+            if (w == -1) {
+                return -1;
+            }
+            written += w;
+        }
+        *out += n;
+        pending -= n;
+    }
+    return 0;
+}
+
+int copy_with_splice(OpenFile* file, off_t* offset, off_t end) {
+    // The pipe comes from the budget, but waiting for it while holding the file could
+    // deadlock; without one the copy falls back to read/write
+    int pipe_fds[2];
+    if (!try_acquire_fds(2)) {
+        return COPY_UNSUPPORTED;
+    }
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        release_fds(2);
+        return COPY_UNSUPPORTED;
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, copy_buffer_size());
+
+    int result = 0;
+    size_t block = first_block();
+    while (end < 0 || *offset < end) {
+        loff_t in = *offset;
+        count_call(CALL_SPLICE);
+        ssize_t n = splice(file->source_fd, &in, pipe_fds[1], NULL,
+                           range_step(*offset, end, block), SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            result = is_unsupported(errno) ? COPY_UNSUPPORTED : -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        block = next_block(block, n);
+
+        // Move everything in the pipe to the destination before advancing the range
+        size_t pending = n;
+        while (pending > 0) {
+            loff_t out = *offset;
+            count_call(CALL_SPLICE);
+            ssize_t w = splice(pipe_fds[0], NULL, file->destination_fd, &out, pending, SPLICE_F_MOVE);
+            if (w == -1 && errno == EINTR) {
+                continue;
+            }
+            if (w == -1) {
+                int error = errno;
+                result = drain_pipe(pipe_fds[0], file->destination_fd, offset, pending);
+                if (result == 0) {
+                    result = is_unsupported(error) ? COPY_UNSUPPORTED : -1;
+                    errno = error;
+                }
+                break;
+            }
+            *offset += w;
+            pending -= w;
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    release_fds(2);
+    return result;
+}
+
+// Clear O_DIRECT on one end of a file, for a transfer that cannot be aligned
+void drop_direct(int fd, int* direct) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+    *direct = 0;
+}
+
+// Push [start, end) of the buffered ends of a file out of the page cache. Dirty pages
+// are not dropped by DONTNEED, so the destination range is written back first.
+void drop_cache(OpenFile* file, off_t start, off_t end) {
+    if (end <= start) {
+        return;
+    }
+    if (!file->source_direct) {
+        posix_fadvise(file->source_fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+    if (!file->destination_direct) {
+        sync_file_range(file->destination_fd, start, end - start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file->destination_fd, start, end - start, POSIX_FADV_DONTNEED);
+    }
+}
+
+int write_all(int fd, const char* data, size_t length, off_t offset) {
+    size_t written = 0;
+    while (written < length) {
+        count_call(CALL_WRITE);
+        ssize_t w = pwrite(fd, data + written, length - written, offset + written);
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w == -1) {
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+}
+
+// O_DIRECT writes must be whole aligned blocks: write the aligned part directly and the
+// unaligned tail of the file through the page cache
+int write_block(OpenFile* file, const char* data, size_t length, off_t offset) {
+    if (file->destination_direct && (offset % DIRECT_ALIGN) == 0) {
+        size_t aligned = length - length % DIRECT_ALIGN;
+        if (aligned > 0 && write_all(file->destination_fd, data, aligned, offset) == -1) {
+            return -1;
+        }
+        data += aligned;
+        offset += aligned;
+        length -= aligned;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    if (file->destination_direct) {
+        drop_direct(file->destination_fd, &file->destination_direct);
+    }
+    return write_all(file->destination_fd, data, length, offset);
+}
+
+int copy_with_read_write(OpenFile* file, off_t* offset, off_t end, char* buffer) {
+    size_t block = first_block();
+    off_t window = *offset;     // start of the range not yet dropped from the cache
+    if (opts.stream != STREAM_OFF && !file->source_direct) {
+        readahead(file->source_fd, *offset, STREAM_WINDOW);
+    }
+
+    while (end < 0 || *offset < end) {
+        size_t step = range_step(*offset, end, block);
+        if (file->source_direct && (*offset % DIRECT_ALIGN) != 0) {
+            drop_direct(file->source_fd, &file->source_direct);     // e.g. an unaligned sparse extent
+        }
+        if (file->source_direct) {
+            step = (step + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        }
+
+        count_call(CALL_READ);
+        ssize_t n = pread(file->source_fd, buffer, step, *offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        // An aligned direct read may run past the end of the range
+        if (end >= 0 && n > end - *offset) {
+            n = end - *offset;
+        }
+
+        if (opts.checksum) {
+            hash_block(&file->crc, buffer, n);
+        }
+        if (write_block(file, buffer, n, *offset) == -1) {
+            return -1;
+        }
+        *offset += n;
+        block = next_block(block, n);
+
+        if (opts.stream != STREAM_OFF && *offset - window >= STREAM_WINDOW) {
+            drop_cache(file, window, *offset);
+            window = *offset;
+            if (!file->source_direct) {
+                readahead(file->source_fd, *offset, STREAM_WINDOW);
+            }
+        }
+    }
+
+    if (opts.stream != STREAM_OFF) {
+        drop_cache(file, window, *offset);
+    }
+    return 0;
+}
+
+// Remember the slowest backend used so it can be reported with the file
+void note_method(FileJob* job, int method) {
+    int current = atomic_load(&job->method);
+    while (current < method && !atomic_compare_exchange_weak(&job->method, &current, method)) {
+    }
+}
+
+// Copy [offset, end) with positional I/O so ranges of one file can be copied concurrently;
+// end -1 copies until end of file. Backends are tried from the configured one down to
+// read/write, resuming where the refused one stopped.
+int copy_data(OpenFile* file, off_t offset, off_t end, char* buffer) {
+    off_t start = offset;
+    int method = atomic_load(&file->job->method);
+    int result = COPY_UNSUPPORTED;
+
+    // In-kernel copies go through the page cache and never show the data to us;
+    // streaming and checksums need the bounce buffer
+    if (opts.stream != STREAM_OFF || opts.checksum) {
+        method = COPY_READ_WRITE;
+    }
+
+    for (; method < COPY_READ_WRITE && result == COPY_UNSUPPORTED; method++) {
+        switch (method) {
+            case COPY_FILE_RANGE: result = copy_with_copy_file_range(file, &offset, end); break;
+            case COPY_SENDFILE:   result = copy_with_sendfile(file, &offset, end); break;
+            default:              result = copy_with_splice(file, &offset, end); break;
+        }
+    }
+
+    if (result == COPY_UNSUPPORTED) {
+        result = copy_with_read_write(file, &offset, end, buffer);
+    } else {
+        method--;
+    }
+
+    note_method(file->job, method);
+    stat_add(&my_stats->bytes, offset - start);
+    return result;
+}
+
+// A hole is not copied, but it still counts as zeros in the range's checksum
+void skip_hole(OpenFile* file, off_t bytes) {
+    stat_add(&my_stats->hole_bytes, bytes);
+    if (opts.checksum) {
+        file->crc = crc32c_zeros(file->crc, bytes);
+    }
+}
+
+// In sparse mode only the data extents of the range are copied; the holes between
+// them are left unwritten so the destination stays sparse
+int copy_range(OpenFile* file, off_t offset, off_t length, char* buffer) {
+    off_t end = length < 0 ? -1 : offset + length;
+    if (!opts.sparse) {
+        return copy_data(file, offset, end, buffer);
+    }
+
+    while (end < 0 || offset < end) {
+        off_t data = lseek(file->source_fd, offset, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) {
+            // Only a hole is left before end of file
+            off_t size = end >= 0 ? end : lseek(file->source_fd, 0, SEEK_END);
+            if (size > offset) {
+                skip_hole(file, size - offset);
+            }
+            break;
+        }
+        if (data == -1) {
+            return copy_data(file, offset, end, buffer);     // no SEEK_DATA support here
+        }
+        if (end >= 0 && data >= end) {
+            skip_hole(file, end - offset);
+            break;
+        }
+        skip_hole(file, data - offset);
+
+        off_t hole = lseek(file->source_fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        if (end >= 0 && hole > end) {
+            hole = end;
+        }
+        if (copy_data(file, data, hole, buffer) == -1) {
+            return -1;
+        }
+        offset = hole;
+    }
+    return 0;
+}
+
+// Re-read a finished destination and compare its CRC32C with the one taken while
+// copying. The cached pages are written back and dropped first, so the check reads
+// what reached the device rather than the copy's own page cache.
+int verify_copy(FileJob* job, int destination_fd, char* buffer, size_t buffer_size) {
+    unsigned long long start = now_ns();
+    count_call(CALL_FSYNC);
+    fdatasync(destination_fd);
+    posix_fadvise(destination_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    uint32_t crc = 0;
+    off_t offset = 0;
+    ssize_t n;
+    while (1) {
+        count_call(CALL_READ);
+        n = pread(destination_fd, buffer, buffer_size, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, n);
+        offset += n;
+    }
+    stat_add(&my_stats->verify_ns, now_ns() - start);
+
+    if (n == -1) {
+        fprintf(stderr, "Error verifying file %s: %s\n", job->destination_file, strerror(errno));
+    } else if (crc != job->crc) {
+        fprintf(stderr, "Verification failed for %s: copied %08x, read back %08x\n",
+                job->destination_file, job->crc, crc);
+    } else {
+        return 1;
+    }
+    atomic_fetch_add(&verify_failures, 1);
+    return 0;
+}
+
+// Settle a copied file's CRC32C from its ranges, verify it if asked and list it in
+// the checksum file. Returns 0 if verification failed.
+int check_copy(FileJob* job, int destination_fd, char* buffer, size_t buffer_size) {
+    if (job->range_crcs != NULL) {
+        job->crc = job->range_crcs[0];
+        for (int i = 1; i < job->chunks; i++) {
+            off_t length = job->size - i * opts.chunk_size;
+            if (length > opts.chunk_size) {
+                length = opts.chunk_size;
+            }
+            job->crc = crc32c_combine(job->crc, job->range_crcs[i], length);
+        }
+    }
+
+    if (opts.verify && !verify_copy(job, destination_fd, buffer, buffer_size)) {
+        return 0;
+    }
+    if (checksum_out != NULL) {
+        fprintf(checksum_out, "%08x  %s\n", job->crc, relative_path(job->source_file));
+    }
+    return 1;
+}
+
+// Report a file once all of its ranges are copied. The last range still holds its
+// descriptors, which finish the destination's size and mtime.
+void finish_chunk(FileJob* job, OpenFile* file, char* buffer) {
+    if (atomic_fetch_add(&job->chunks_done, 1) + 1 < job->chunks) {
+        return;
+    }
+
+    if (atomic_load(&job->failed)) {
+        free_job(job);
+        return;
+    }
+
+    // Trailing holes were never written, so extend the destination to the source's size
+    struct stat st;
+    if (opts.sparse && file != NULL && fstat(file->source_fd, &st) == 0 &&
+        ftruncate(file->destination_fd, st.st_size) == -1) {
+        fprintf(stderr, "Error sizing file %s: %s\n", job->destination_file, strerror(errno));
+    }
+
+    if (opts.incremental && file != NULL) {
+        preserve_mtime(file->destination_fd, job->mtime);
+    }
+    if (opts.checksum && file != NULL && !check_copy(job, file->destination_fd, buffer, copy_buffer_size())) {
+        free_job(job);
+        return;
+    }
+    if (opts.sync == SYNC_FILE && file != NULL) {
+        count_call(CALL_FSYNC);
+        if (fdatasync(file->destination_fd) == -1) {
+            fprintf(stderr, "Error syncing file %s: %s\n", job->destination_file, strerror(errno));
+        }
+    } else if (opts.sync == SYNC_GROUP) {
+        queue_sync(job->destination_file);
+    }
+    journal_append(JOURNAL_FILE, job, 0, job->size);
+    record_copied(job);
+    record_latency(job->size, now_ns() - atomic_load(&job->started_ns));
+    stat_add(&my_stats->files, 1);
+    fprintf(my_reports != NULL ? my_reports : stdout, "Copied file: %s (%s)\n", job->source_file,
+            copy_method_names[atomic_load(&job->method)]);
+    free_job(job);
+}
+
+// Copy a range in JOURNAL_STEP pieces, journaling each one, so an interrupted copy of
+// a large file loses at most a step per consumer. An interrupt stops between steps.
+int copy_steps(OpenFile* file, off_t offset, off_t length, char* buffer) {
+    FileJob* job = file->job;
+    off_t end = length < 0 ? job->size : offset + length;
+
+    while (1) {
+        int last = offset + JOURNAL_STEP >= end;
+        off_t step_end = last ? end : offset + JOURNAL_STEP;
+        // The last piece of an until-EOF range still runs to EOF
+        if (copy_range(file, offset, last && length < 0 ? -1 : step_end - offset, buffer) == -1) {
+            return -1;
+        }
+        journal_append(JOURNAL_RANGE, job, offset, step_end);
+        if (last) {
+            return 0;
+        }
+        offset = step_end;
+        if (done) {
+            return -1;
+        }
+    }
+}
+
+// Open, copy and close one range of a file
+void copy_file_item(FileJob* job, off_t offset, off_t length, char* buffer) {
+    // The first range to start marks the beginning of the file's latency
+    unsigned long long unset = 0;
+    atomic_compare_exchange_strong(&job->started_ns, &unset, now_ns());
+
+    OpenFile file;
+    if (!open_file(job, &file)) {
+        finish_chunk(job, NULL, buffer);
+        return;
+    }
+
+    if (copy_steps(&file, offset, length, buffer) == -1) {
+        if (!done) {
+            fprintf(stderr, "Error copying file %s: %s\n", job->source_file, strerror(errno));
+        }
+        atomic_store(&job->failed, 1);
+    } else if (opts.checksum) {
+        *(job->range_crcs != NULL ? &job->range_crcs[offset / opts.chunk_size] : &job->crc) = file.crc;
+    }
+
+    finish_chunk(job, &file, buffer);
+    close_file(&file);
+}
+
+// Copy one dequeued item: a batch of small files or a range of one file
+void consume_item(WorkItem* item, char* buffer) {
+    FileJob* job = item->job;
+
+    // After an interrupt the queue is only drained: nothing new is started
+    if (done) {
+        while (job != NULL) {
+            FileJob* next = job->batched ? job->batch_next : NULL;
+            atomic_store(&job->failed, 1);
+            finish_chunk(job, NULL, buffer);
+            job = next;
+        }
+        return;
+    }
+
+    // A batch of small files: copy them back to back and print all their reports in one
+    // write at the end. stdout is not locked meanwhile: opening a file can wait for
+    // descriptors that other consumers only give back once they have printed.
+    if (job->batched) {
+        char* reports = NULL;
+        size_t length = 0;
+        my_reports = open_memstream(&reports, &length);
+        while (job != NULL) {
+            FileJob* next = job->batch_next;
+            copy_file_item(job, 0, -1, buffer);
+            job = next;
+        }
+        if (my_reports != NULL) {
+            fclose(my_reports);
+            my_reports = NULL;
+            fwrite(reports, 1, length, stdout);
+        }
+        free(reports);
+        return;
+    }
+
+    copy_file_item(job, item->offset, item->length, buffer);
+}
+
+// Returns 0 once the buffer is drained and the producer is done
+int consume_file_descriptor_pair(char* buffer) {
+    unsigned long long waiting = now_ns();
+    WorkItem item;
+    if (!dequeue_work(&item)) {
+        stat_add(&my_stats->wait_ns, now_ns() - waiting);
+        return 0;
+    }
+
+    unsigned long long copying = now_ns();
+    stat_add(&my_stats->wait_ns, copying - waiting);
+
+    consume_item(&item, buffer);
+
+    unsigned long long done_ns = now_ns();
+    stat_add(&my_stats->copy_ns, done_ns - copying);
+    stat_add(&my_stats->items, 1);
+    atomic_store_explicit(&my_stats->last_done_ns, done_ns, memory_order_relaxed);
+    return 1;
+}
+
+// Apply --include and --exclude to a source path. A glob containing '/' is matched
+// against the path relative to the source, any other against the last component.
+// Includes only select files, so a directory is kept unless an exclude matches it.
+int is_selected(const char* source_file, int directory) {
+    if (opts.include_count == 0 && opts.exclude_count == 0) {
+        return 1;
+    }
+    const char* path = relative_path(source_file);
+    const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    for (int i = 0; i < opts.exclude_count; i++) {
+        if (fnmatch(opts.excludes[i], strchr(opts.excludes[i], '/') ? path : name, 0) == 0) {
+            return 0;
+        }
+    }
+    if (directory || opts.include_count == 0) {
+        return 1;
+    }
+    for (int i = 0; i < opts.include_count; i++) {
+        if (fnmatch(opts.includes[i], strchr(opts.includes[i], '/') ? path : name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void scan_queue_push(ScanQueue* queue, ScanTask* task) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? queue->capacity * 2 : 16;
+        ScanTask** tasks = malloc(capacity * sizeof(ScanTask*));
+        for (int i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Take the most recently pushed task (own queue) or the oldest one (stealing)
+ScanTask* scan_queue_take(ScanQueue* queue, int steal) {
+    ScanTask* task = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->count > 0) {
+        if (steal) {
+            task = queue->tasks[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        } else {
+            task = queue->tasks[(queue->head + queue->count - 1) % queue->capacity];
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
+}
+
+void add_scan_task(int scanner, const char* source_dir, const char* destination_dir) {
+    ScanTask* task = malloc(sizeof(ScanTask));
+    snprintf(task->source_dir, sizeof(task->source_dir), "%s", source_dir);
+    snprintf(task->destination_dir, sizeof(task->destination_dir), "%s", destination_dir);
+
+    pthread_mutex_lock(&scanners.mutex);
+    scanners.pending++;
+    pthread_mutex_unlock(&scanners.mutex);
+
+    scan_queue_push(&scanners.queues[scanner], task);
+
+    pthread_mutex_lock(&scanners.mutex);
+    scanners.queued++;
+    pthread_cond_signal(&scanners.work_available);
+    pthread_mutex_unlock(&scanners.mutex);
+}
+
+// Next directory for a scanner, or NULL once the whole tree has been scanned
+ScanTask* next_scan_task(int scanner) {
+    while (1) {
+        pthread_mutex_lock(&scanners.mutex);
+        unsigned long long queued = scanners.queued;
+        pthread_mutex_unlock(&scanners.mutex);
+
+        ScanTask* task = scan_queue_take(&scanners.queues[scanner], 0);
+        for (int i = 1; task == NULL && i < scanners.count; i++) {
+            task = scan_queue_take(&scanners.queues[(scanner + i) % scanners.count], 1);
+        }
+        if (task != NULL) {
+            return task;
+        }
+
+        // Nothing to steal: hand over pending small files, then sleep until someone
+        // queues a directory or the scan finishes
+        flush_batch();
+        pthread_mutex_lock(&scanners.mutex);
+        if (scanners.pending == 0) {
+            pthread_mutex_unlock(&scanners.mutex);
+            return NULL;
+        }
+        if (scanners.queued == queued) {
+            pthread_cond_wait(&scanners.work_available, &scanners.mutex);
+        }
+        pthread_mutex_unlock(&scanners.mutex);
+    }
+}
+
+void scan_directory(int scanner, ScanTask* task) {
+    if (done) {
+        return;     // interrupted: let the remaining tasks drain
+    }
+    DIR* dir = opendir(task->source_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening directory %s: %s\n", task->source_dir, strerror(errno));
+        return;
+    }
+    DirHandle* handle = open_dir_handle(dirfd(dir), task->destination_dir);
+
+    struct dirent* entry;
+    while (!done && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char source_file[PATH_MAX];
+        char destination_file[PATH_MAX];
+        if (snprintf(source_file, sizeof(source_file), "%s/%s", task->source_dir, entry->d_name) >= (int)sizeof(source_file) ||
+            snprintf(destination_file, sizeof(destination_file), "%s/%s", task->destination_dir, entry->d_name) >= (int)sizeof(destination_file)) {
+            fprintf(stderr, "Skipping path that is too long: %s/%s\n", task->source_dir, entry->d_name);
+            continue;
+        }
+
+        int type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN || type == DT_DIR) {
+            count_call(CALL_STAT);
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                fprintf(stderr, "Error reading file status %s: %s\n", source_file, strerror(errno));
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (!is_selected(source_file, type == DT_DIR)) {
+            continue;
+        }
+
+        if (type == DT_DIR) {
+            // Create the destination first so files found below it can be opened
+            int made = handle != NULL ? mkdirat(handle->destination_fd, entry->d_name, (st.st_mode & 07777) | S_IRWXU)
+                                      : mkdir(destination_file, (st.st_mode & 07777) | S_IRWXU);
+            if (made == -1 && errno != EEXIST) {
+                fprintf(stderr, "Error creating directory %s: %s\n", destination_file, strerror(errno));
+                continue;
+            }
+            add_scan_task(scanner, source_file, destination_file);
+        } else if (type == DT_REG) {
+            produce_file_descriptor_pair(handle, source_file, destination_file);
+        } else {
+            fprintf(stderr, "Skipping non-regular file: %s\n", source_file);
+        }
+    }
+
+    release_dir_handle(handle);
+    closedir(dir);
+}
+
+void* scanner_thread(void* arg) {
+    int scanner = (int)(long)arg;
+    register_thread_stats("scanner", scanner);
+
+    ScanTask* task;
+    while ((task = next_scan_task(scanner)) != NULL) {
+        scan_directory(scanner, task);
+        free(task);
+
+        pthread_mutex_lock(&scanners.mutex);
+        if (--scanners.pending == 0) {
+            pthread_cond_broadcast(&scanners.work_available);
+        }
+        pthread_mutex_unlock(&scanners.mutex);
+    }
+
+    return NULL;
+}
+
+// Walk the source tree with a pool of scanner threads, then tell the consumers no more work is coming
+void* producer_thread(void* arg) {
+    char** directories = (char**)arg;
+    char* source_dir = directories[0];
+    char* destination_dir = directories[1];
+
+    if (mkdir(destination_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory %s: %s\n", destination_dir, strerror(errno));
+    } else {
+        scanners.count = opts.scanners;
+        scanners.queues = calloc(scanners.count, sizeof(ScanQueue));
+        for (int i = 0; i < scanners.count; i++) {
+            pthread_mutex_init(&scanners.queues[i].mutex, NULL);
+        }
+        pthread_mutex_init(&scanners.mutex, NULL);
+        pthread_cond_init(&scanners.work_available, NULL);
+
+        add_scan_task(0, source_dir, destination_dir);
+
+        pthread_t scanner_tids[scanners.count];
+        for (int i = 0; i < scanners.count; i++) {
+            pthread_create(&scanner_tids[i], NULL, scanner_thread, (void*)(long)i);
+        }
+        for (int i = 0; i < scanners.count; i++) {
+            pthread_join(scanner_tids[i], NULL);
+        }
+
+        for (int i = 0; i < scanners.count; i++) {
+            pthread_mutex_destroy(&scanners.queues[i].mutex);
+            free(scanners.queues[i].tasks);
+        }
+        free(scanners.queues);
+        pthread_mutex_destroy(&scanners.mutex);
+        pthread_cond_destroy(&scanners.work_available);
+    }
+
+    drain_scheduler();
+    finish_producing();
+
+    return NULL;
+}
+
+// Next entry of a NUL-separated list, or NULL at end of input; a last entry without
+// its terminator still counts. The entry is only valid until the next call.
+char* next_list_entry(ListReader* reader) {
+    while (1) {
+        char* nul = memchr(reader->data + reader->start, '\0', reader->end - reader->start);
+        if (nul != NULL) {
+            char* entry = reader->data + reader->start;
+            reader->start = nul - reader->data + 1;
+            return entry;
+        }
+
+        // Keep the partial entry at the front and make room behind it
+        memmove(reader->data, reader->data + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->end == reader->capacity) {
+            reader->capacity *= 2;
+            reader->data = realloc(reader->data, reader->capacity);
+        }
+
+        if (reader->eof) {
+            if (reader->end == 0) {
+                return NULL;
+            }
+            reader->data[reader->end++] = '\0';
+            continue;
+        }
+
+        // About to wait for a slow upstream: queue the small files read so far, so
+        // copying keeps pace with the listing instead of waiting for a full batch
+        struct pollfd ready = { .fd = reader->fd, .events = POLLIN };
+        if (poll(&ready, 1, 0) == 0) {
+            flush_batch();
+        }
+        count_call(CALL_READ);
+        ssize_t n = read(reader->fd, reader->data + reader->end, reader->capacity - reader->end);
+        if (n == -1) {
+            if (errno == EINTR && !done) {
+                continue;
+            }
+            if (errno != EINTR) {
+                perror("Error reading file list");
+            }
+            return NULL;
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
+    }
+}
+
+// Create the missing directories above a destination file, like mkdir -p. Lists name
+// files of one directory together, so the last parent made is remembered.
+int make_parents(const char* path) {
+    static char last[PATH_MAX];     // only the list reader calls this
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char* slash = strrchr(parent, '/');
+    if (slash == NULL || slash == parent || (*slash = '\0', strcmp(parent, last) == 0)) {
+        return 0;
+    }
+
+    if (mkdir(parent, 0755) == -1 && errno == ENOENT) {
+        for (char* p = parent + 1; *p != '\0'; p++) {
+            if (*p == '/') {
+                *p = '\0';
+                if (mkdir(parent, 0755) == -1 && errno != EEXIST) {
+                    fprintf(stderr, "Error creating directory %s: %s\n", parent, strerror(errno));
+                    return -1;
+                }
+                *p = '/';
+            }
+        }
+        if (mkdir(parent, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Error creating directory %s: %s\n", parent, strerror(errno));
+            return -1;
+        }
+    }
+    snprintf(last, sizeof(last), "%s", parent);
+    return 0;
+}
+
+// Copy the files named by a --files-from list while it is still being written. Entries
+// are paths below the source directory (with or without it in front, as find prints
+// them), or with --pairs alternating source and destination paths.
+void* list_thread(void* arg) {
+    char** directories = (char**)arg;
+    char* source_dir = directories[0];
+    char* destination_dir = directories[1];
+    register_thread_stats("reader", 0);
+
+    if (!opts.pairs && mkdir(destination_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory %s: %s\n", destination_dir, strerror(errno));
+        drain_scheduler();
+        finish_producing();
+        return NULL;
+    }
+
+    ListReader reader = { .fd = list_fd, .capacity = LIST_BUFFER_SIZE };
+    reader.data = malloc(reader.capacity);
+    list_tid = pthread_self();
+    list_reading = 1;
+    size_t root_length = strlen(source_dir);
+    char* entry;
+    while (!done && (entry = next_list_entry(&reader)) != NULL) {
+        if (entry[0] == '\0') {
+            continue;
+        }
+
+        char source_file[PATH_MAX];
+        char destination_file[PATH_MAX];
+        int too_long;
+        if (opts.pairs) {
+            too_long = snprintf(source_file, sizeof(source_file), "%s", entry) >= (int)sizeof(source_file);
+            if ((entry = next_list_entry(&reader)) == NULL) {
+                fprintf(stderr, "File list ends without a destination for %s\n", source_file);
+                break;
+            }
+            too_long |= snprintf(destination_file, sizeof(destination_file), "%s", entry) >= (int)sizeof(destination_file);
+        } else {
+            const char* relative = entry;
+            if (strncmp(relative, source_dir, root_length) == 0 && relative[root_length] == '/') {
+                relative += root_length;
+            }
+            while (*relative == '/' || (relative[0] == '.' && relative[1] == '/')) {
+                relative += *relative == '/' ? 1 : 2;
+            }
+            if (*relative == '\0' || strcmp(relative, ".") == 0 || strcmp(relative, source_dir) == 0) {
+                continue;   // the source directory itself
+            }
+            too_long = snprintf(source_file, sizeof(source_file), "%s/%s", source_dir, relative) >= (int)sizeof(source_file) ||
+                       snprintf(destination_file, sizeof(destination_file), "%s/%s", destination_dir, relative) >= (int)sizeof(destination_file);
+        }
+        if (too_long) {
+            fprintf(stderr, "Skipping path that is too long: %s\n", entry);
+            continue;
+        }
+
+        struct stat st;
+        count_call(CALL_STAT);
+        if (lstat(source_file, &st) == -1) {
+            fprintf(stderr, "Error reading file status %s: %s\n", source_file, strerror(errno));
+            continue;
+        }
+        if (!is_selected(source_file, S_ISDIR(st.st_mode))) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && !opts.pairs) {
+            // Listed directories are created even if nothing below them is copied
+            if (make_parents(destination_file) == -1 ||
+                (mkdir(destination_file, (st.st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)) {
+                fprintf(stderr, "Error creating directory %s: %s\n", destination_file, strerror(errno));
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (make_parents(destination_file) == 0) {
+                produce_file_descriptor_pair(NULL, source_file, destination_file);
+            }
+        } else {
+            fprintf(stderr, "Skipping non-regular file: %s\n", source_file);
+        }
+    }
+    list_reading = 0;
+    free(reader.data);
+
+    flush_batch();
+    drain_scheduler();
+    finish_producing();
+
+    return NULL;
+}
+
+// NUMA topology from sysfs: the CPUs of each node. Machines without the node
+// directory are treated as one node holding every CPU we may run on.
+cpu_set_t node_cpus[MAX_NODES];
+int node_count;
+int device_node = -1;           // node of the device PLACE_SOURCE/PLACE_DESTINATION pairs with
+
+// Parse a kernel CPU list such as "0-3,8,10-11" into an array; returns the count
+int parse_cpu_list(const char* text, int* cpus, int max) {
+    int count = 0;
+    while (*text != '\0' && *text != '\n') {
+        char* end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last && count < max; cpu++) {
+            cpus[count++] = (int)cpu;
+        }
+        text = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0' && *end != '\n') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+void load_topology() {
+    int cpus[CPU_SETSIZE];
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64];
+        char list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* in = fopen(path, "r");
+        if (in == NULL) {
+            continue;
+        }
+        CPU_ZERO(&node_cpus[node]);
+        if (fgets(list, sizeof(list), in) != NULL) {
+            int count = parse_cpu_list(list, cpus, CPU_SETSIZE);
+            for (int i = 0; i < count; i++) {
+                CPU_SET(cpus[i], &node_cpus[node]);
+            }
+        }
+        fclose(in);
+        node_count = node + 1;
+    }
+
+    if (node_count == 0) {
+        node_count = 1;
+        sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]);
+    }
+}
+
+int cpu_node(int cpu) {
+    for (int node = 0; node < node_count; node++) {
+        if (CPU_ISSET(cpu, &node_cpus[node])) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+// NUMA node of the block device holding path: walk up from its sysfs device until a
+// numa_node attribute turns up (a partition's disk, then the disk's controller).
+// Returns -1 when there is no such device or the platform does not say.
+int device_numa_node(const char* path) {
+    struct stat st;
+    char link[64];
+    char device[PATH_MAX];
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(st.st_dev), minor(st.st_dev));
+    if (realpath(link, device) == NULL) {
+        return -1;
+    }
+
+    while (strlen(device) > strlen("/sys/devices")) {
+        char attribute[PATH_MAX + 16];
+        snprintf(attribute, sizeof(attribute), "%s/numa_node", device);
+        FILE* in = fopen(attribute, "r");
+        if (in != NULL) {
+            int node = -1;
+            if (fscanf(in, "%d", &node) != 1) {
+                node = -1;
+            }
+            fclose(in);
+            return node;
+        }
+        *strrchr(device, '/') = '\0';
+    }
+    return -1;
+}
 
-Buffer buf;
-int done = 0;
+// Pin the calling consumer according to opts.placement; returns its node or -1
+int place_consumer(int id) {
+    cpu_set_t set;
+    int node = -1;
+    switch (opts.placement) {
+        case PLACE_NONE:
+            return -1;
+        case PLACE_CPUS: {
+            int cpu = opts.cpus[id % opts.cpu_count];
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            node = cpu_node(cpu);
+            break;
+        }
+        case PLACE_SOURCE:
+        case PLACE_DESTINATION:
+            if (device_node >= 0 && device_node < node_count && CPU_COUNT(&node_cpus[device_node]) > 0) {
+                node = device_node;
+                set = node_cpus[node];
+                break;
+            }
+            // Device node unknown: spread instead
+            // fall through
+        case PLACE_SPREAD: {
+            // Skip memory-only nodes
+            int nodes[MAX_NODES];
+            int usable = 0;
+            for (int i = 0; i < node_count; i++) {
+                if (CPU_COUNT(&node_cpus[i]) > 0) {
+                    nodes[usable++] = i;
+                }
+            }
+            node = nodes[id % usable];
+            set = node_cpus[node];
+            break;
+        }
+    }
 
-void init_buffer() {
-    buf.in = 0;
-    buf.out = 0;
-    buf.count = 0;
-    buf.done = 0;
-    pthread_mutex_init(&buf.mutex, NULL);
-    pthread_cond_init(&buf.not_full, NULL);
-    pthread_cond_init(&buf.not_empty, NULL);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        fprintf(stderr, "Error pinning consumer %d: %s\n", id, strerror(error));
+    }
+    my_stats->node = node;
+    return node;
+}
+
+// Copy buffers come straight from mmap (page aligned, so fine for O_DIRECT) and are
+// bound to the consumer's node before first touch
+char* alloc_buffer(size_t size, int node) {
+    char* buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+        perror("Error allocating copy buffer");
+        exit(1);
+    }
+    if (node >= 0) {
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, buffer, size, MPOL_PREFERRED, mask, MAX_NODES + 1, 0) == -1) {
+            perror("Error binding copy buffer");
+        }
+    }
+    return buffer;
 }
 
-void cleanup_buffer() {
-    pthread_mutex_destroy(&buf.mutex);
-    pthread_cond_destroy(&buf.not_full);
-    pthread_cond_destroy(&buf.not_empty);
+void* consumer_thread(void* arg) {
+    int id = (int)(long)arg;
+    // An auto pool starts most consumers parked; they set up when first needed, so
+    // one that never runs leaves no counters or buffer behind
+    if (!wait_until_active(id)) {
+        return NULL;
+    }
+    register_thread_stats("consumer", id);
+
+    // Bounce buffer for the read/write fallback, on the consumer's own node
+    int node = place_consumer(id);
+    size_t size = copy_buffer_size();
+    char* buffer = alloc_buffer(size, node);
+    while (wait_until_active(id) && consume_file_descriptor_pair(buffer)) {
+    }
+
+    munmap(buffer, size);
+    return NULL;
 }
 
-void produce_file_descriptor_pair(const char* source_file, const char* destination_file) {
-    pthread_mutex_lock(&buf.mutex);
+// Minimal io_uring wrapper over the raw syscalls: the mapped submission and completion rings
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+} Uring;
+
+typedef enum {
+    URING_OPEN,
+    URING_ALLOCATE,
+    URING_COPY,
+    URING_SYNC,
+    URING_CLOSE
+} UringStage;
+
+// One copy in flight; user_data of its requests is (slot << 2) | tag
+typedef struct {
+    FileJob* job;
+    UringStage stage;
+    int pending;
+    int failed;
+    int source_fd;
+    int destination_fd;
+    off_t offset;
+    size_t filled;
+    size_t written;
+    char* buffer;
+    size_t buffer_size;
+    uint32_t crc;
+    unsigned long long started_ns;
+} UringCopy;
+
+#define URING_TAG_SOURCE 0
+#define URING_TAG_DESTINATION 1
+#define URING_TAG_IO 2
 
-    // Wait while buffer is full
-    while (buf.count == BUFFER_SIZE) {
-        pthread_cond_wait(&buf.not_full, &buf.mutex);
+int uring_init(Uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
     }
 
-    // Open source file for reading
-    int source_fd = open(source_file, O_RDONLY);
-    if (source_fd == -1) {
-        fprintf(stderr, "Error opening file: %s\n", strerror(errno));
-        pthread_mutex_unlock(&buf.mutex);
-        return;
+    ring->entries = params.sq_entries;
+    ring->to_submit = 0;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
     }
 
-    // Create or truncate destination file
-    int destination_fd = open(destination_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (destination_fd == -1) {
-        fprintf(stderr, "Error opening file: %s\n", strerror(errno));
-        close(source_fd);
-        pthread_mutex_unlock(&buf.mutex);
-        return;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
     }
 
-    // Copy file descriptors and file names to buffer
-    buf.buffer[buf.in].source_fd = source_fd;
-    buf.buffer[buf.in].destination_fd = destination_fd;
-    strcpy(buf.buffer[buf.in].source_file, source_file);
-    strcpy(buf.buffer[buf.in].destination_file, destination_file);
-    buf.in = (buf.in + 1) % BUFFER_SIZE;
-    buf.count++;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
 
-    pthread_cond_signal(&buf.not_empty);
-    pthread_mutex_unlock(&buf.mutex);
+void uring_cleanup(Uring* ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
 }
 
-void consume_file_descriptor_pair() {
-    pthread_mutex_lock(&buf.mutex);
+// Queue a zeroed submission entry; the caller never has more than ring->entries outstanding
+struct io_uring_sqe* uring_get_sqe(Uring* ring, __u64 user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
 
-    // Wait while buffer is empty and producer is not done
-    while (buf.count == 0 && !buf.done) {
-        pthread_cond_wait(&buf.not_empty, &buf.mutex);
+// Submit queued entries and wait for at least min_complete completions
+int uring_enter(Uring* ring, unsigned min_complete) {
+    count_call(CALL_URING_ENTER);
+    int result = syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (result >= 0) {
+        ring->to_submit -= result;
+    } else if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        // Interrupted, or short of resources until completions are reaped: try again
+        result = 0;
     }
+    return result;
+}
 
-    // Return if buffer is empty and producer is done
-    if (buf.count == 0 && buf.done) {
-        pthread_mutex_unlock(&buf.mutex);
-        return;
+void uring_open(Uring* ring, int slot, int tag, FileJob* job, int flags) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, ((__u64)slot << 2) | tag);
+    sqe->opcode = IORING_OP_OPENAT;
+    if (job->dir != NULL) {
+        sqe->fd = tag == URING_TAG_SOURCE ? job->dir->source_fd : job->dir->destination_fd;
+        sqe->addr = (__u64)(uintptr_t)job->name;
+    } else {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (__u64)(uintptr_t)(tag == URING_TAG_SOURCE ? job->source_file : job->destination_file);
     }
+    sqe->len = 0644;
+    sqe->open_flags = flags;
+}
+
+void uring_close(Uring* ring, int slot, int tag, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, ((__u64)slot << 2) | tag);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+}
 
-    // Get file descriptors and file names from buffer
-    int source_fd = buf.buffer[buf.out].source_fd;
-    int destination_fd = buf.buffer[buf.out].destination_fd;
+void uring_rw(Uring* ring, int slot, int opcode, int fd, void* data, size_t length, off_t offset) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, ((__u64)slot << 2) | URING_TAG_IO);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)data;
+    sqe->len = length;
+    sqe->off = offset;
+}
 
-    // Copy file content from source to destination
-    ssize_t n;
-    char buffer[4096];
-    while ((n = read(source_fd, buffer, sizeof(buffer))) > 0) {
-        write(destination_fd, buffer, n);
+void uring_fallocate(Uring* ring, int slot, int fd, off_t size) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, ((__u64)slot << 2) | URING_TAG_IO);
+    sqe->opcode = IORING_OP_FALLOCATE;
+    sqe->fd = fd;
+    sqe->off = 0;
+    sqe->addr = size;
+    sqe->len = FALLOC_FL_KEEP_SIZE;
+    count_call(CALL_FALLOCATE);
+}
+
+void uring_fdatasync(Uring* ring, int slot, int fd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(ring, ((__u64)slot << 2) | URING_TAG_IO);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    count_call(CALL_FSYNC);
+}
+
+size_t uring_block(UringCopy* copy) {
+    size_t block = atomic_load_explicit(&io_block_size, memory_order_relaxed);
+    return block < copy->buffer_size ? block : copy->buffer_size;
+}
+
+void uring_start_copy(Uring* ring, UringCopy* copies, int slot, FileJob* job) {
+    UringCopy* copy = &copies[slot];
+    copy->job = job;
+    copy->stage = URING_OPEN;
+    copy->pending = 0;
+    copy->failed = 0;
+    copy->source_fd = -1;
+    copy->destination_fd = -1;
+    copy->offset = 0;
+    copy->crc = 0;
+    copy->started_ns = now_ns();
+
+    uring_open(ring, slot, URING_TAG_SOURCE, job, O_RDONLY);
+}
+
+void uring_start_reading(Uring* ring, UringCopy* copy, int slot) {
+    copy->stage = URING_COPY;
+    copy->filled = 0;
+    copy->written = 0;
+    uring_rw(ring, slot, IORING_OP_READ, copy->source_fd, copy->buffer, uring_block(copy), copy->offset);
+}
+
+// Close whichever descriptors were opened; the copy is finished when both closes complete
+void uring_finish_copy(Uring* ring, UringCopy* copy, int slot) {
+    copy->stage = URING_CLOSE;
+    copy->pending = 0;
+    if (copy->source_fd >= 0) {
+        uring_close(ring, slot, URING_TAG_SOURCE, copy->source_fd);
+        copy->source_fd = -1;
+        copy->pending++;
+    }
+    if (copy->destination_fd >= 0) {
+        uring_close(ring, slot, URING_TAG_DESTINATION, copy->destination_fd);
+        copy->destination_fd = -1;
+        copy->pending++;
     }
+}
+
+// Advance a copy's state machine by one completion; returns 1 when the slot becomes free
+int uring_complete(Uring* ring, UringCopy* copies, int slot, int tag, int result) {
+    UringCopy* copy = &copies[slot];
+
+    switch (copy->stage) {
+        case URING_OPEN:
+            if (result < 0) {
+                fprintf(stderr, "Error opening file: %s\n", strerror(-result));
+                copy->failed = 1;
+                break;
+            }
+            if (tag == URING_TAG_SOURCE) {
+                // Like the threads engine, the destination is only created or truncated
+                // once the source has opened
+                copy->source_fd = result;
+                uring_open(ring, slot, URING_TAG_DESTINATION, copy->job,
+                           (opts.verify ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC);
+                return 0;
+            }
+            copy->destination_fd = result;
+            if (opts.preallocate && copy->job->size > 0) {
+                copy->stage = URING_ALLOCATE;
+                uring_fallocate(ring, slot, copy->destination_fd, copy->job->size);
+                return 0;
+            }
+            uring_start_reading(ring, copy, slot);
+            return 0;
+
+        case URING_ALLOCATE:
+            // Preallocation is only a hint; copy regardless
+            if (result < 0 && result != -EOPNOTSUPP) {
+                fprintf(stderr, "Error preallocating file %s: %s\n", copy->job->destination_file, strerror(-result));
+            }
+            uring_start_reading(ring, copy, slot);
+            return 0;
 
-    // Close files and print completion status
-    close(source_fd);
-    close(destination_fd);
-    printf("Copied file: %s\n", buf.buffer[buf.out].source_file);
+        case URING_COPY:
+            if (done) {
+                copy->failed = 1;
+                break;
+            }
+            if (result < 0) {
+                fprintf(stderr, "Error copying file %s: %s\n", copy->job->source_file, strerror(-result));
+                copy->failed = 1;
+                break;
+            }
+            if (copy->filled == 0) {
+                // A read completed; an empty read means end of file
+                if (result == 0) {
+                    if (opts.incremental) {
+                        preserve_mtime(copy->destination_fd, copy->job->mtime);
+                    }
+                    // Verification re-reads synchronously; it stalls the ring, not correctness
+                    copy->job->crc = copy->crc;
+                    if (opts.checksum && !check_copy(copy->job, copy->destination_fd, copy->buffer, copy->buffer_size)) {
+                        copy->failed = 1;
+                        break;
+                    }
+                    if (opts.sync == SYNC_FILE) {
+                        copy->stage = URING_SYNC;
+                        uring_fdatasync(ring, slot, copy->destination_fd);
+                        return 0;
+                    }
+                    break;
+                }
+                copy->filled = result;
+                if (opts.checksum) {
+                    hash_block(&copy->crc, copy->buffer, result);
+                }
+            } else {
+                copy->written += result;
+                stat_add(&my_stats->bytes, result);
+            }
 
-    buf.out = (buf.out + 1) % BUFFER_SIZE;
-    buf.count--;
+            if (copy->written < copy->filled) {
+                uring_rw(ring, slot, IORING_OP_WRITE, copy->destination_fd, copy->buffer + copy->written,
+                         copy->filled - copy->written, copy->offset + copy->written);
+            } else {
+                copy->offset += copy->filled;
+                copy->filled = 0;
+                copy->written = 0;
+                uring_rw(ring, slot, IORING_OP_READ, copy->source_fd, copy->buffer, uring_block(copy), copy->offset);
+            }
+            return 0;
+
+        case URING_SYNC:
+            if (result < 0) {
+                fprintf(stderr, "Error syncing file %s: %s\n", copy->job->destination_file, strerror(-result));
+            }
+            break;
+
+        case URING_CLOSE:
+            if (--copy->pending > 0) {
+                return 0;
+            }
+            if (!copy->failed) {
+                if (opts.sync == SYNC_GROUP) {
+                    queue_sync(copy->job->destination_file);
+                }
+                journal_append(JOURNAL_FILE, copy->job, 0, copy->job->size);
+                record_latency(copy->offset, now_ns() - copy->started_ns);
+                stat_add(&my_stats->files, 1);
+                record_copied(copy->job);
+                printf("Copied file: %s (io_uring)\n", copy->job->source_file);
+            }
+            free_job(copy->job);
+            copy->job = NULL;
+            return 1;
+    }
 
-    pthread_cond_signal(&buf.not_full);
-    pthread_mutex_unlock(&buf.mutex);
+    uring_finish_copy(ring, copy, slot);
+    if (copy->pending == 0) {
+        free_job(copy->job);
+        copy->job = NULL;
+        return 1;
+    }
+    return 0;
 }
 
-void* producer_thread(void* arg) {
-    char** directories = (char**)arg;
-    char* source_dir = directories[0];
-    char* destination_dir = directories[1];
+// The ring is unusable: fail every copy in flight and give back its descriptors
+void uring_abandon(UringCopy* copies, int count) {
+    for (int i = 0; i < count; i++) {
+        UringCopy* copy = &copies[i];
+        if (copy->job == NULL) {
+            continue;
+        }
+        fprintf(stderr, "Error copying file %s: io_uring failed\n", copy->job->source_file);
+        atomic_store(&copy->job->failed, 1);
+        if (copy->source_fd >= 0) {
+            close(copy->source_fd);
+        }
+        if (copy->destination_fd >= 0) {
+            close(copy->destination_fd);
+        }
+        free_job(copy->job);
+        copy->job = NULL;
+        release_fds(2);
+    }
+}
 
-    DIR* dir = opendir(source_dir);
-    if (dir == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", strerror(errno));
+// io_uring engine: one thread keeps up to opts.uring_depth copies in flight
+void* uring_thread(void* arg) {
+    register_thread_stats("consumer", (int)(long)arg);
+    int node = place_consumer((int)(long)arg);
+
+    Uring ring;
+    acquire_fds(1);
+    if (uring_init(&ring, opts.uring_depth * 2) == -1) {
+        fprintf(stderr, "Error setting up io_uring: %s\n", strerror(errno));
+        release_fds(1);
+        WorkItem item;
+        while (dequeue_work(&item)) {
+            free_job(item.job);
+        }
         return NULL;
     }
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            char source_file[512];
-            snprintf(source_file, sizeof(source_file), "%s/%s", source_dir, entry->d_name);
+    UringCopy* copies = calloc(opts.uring_depth, sizeof(UringCopy));
+    int* free_slots = malloc(opts.uring_depth * sizeof(int));
+    int free_count = opts.uring_depth;
+    for (int i = 0; i < opts.uring_depth; i++) {
+        copies[i].buffer_size = opts.auto_block ? URING_AUTO_BLOCK_SIZE : opts.block_size;
+        copies[i].buffer = alloc_buffer(copies[i].buffer_size, node);
+        free_slots[i] = opts.uring_depth - 1 - i;
+    }
 
-            char destination_file[512];
-            snprintf(destination_file, sizeof(destination_file), "%s/%s", destination_dir, entry->d_name);
+    while (1) {
+        // Fill free slots; only block on the queue when nothing is in flight
+        WorkItem item;
+        while (free_count > 0) {
+            int idle = free_count == opts.uring_depth;
+            unsigned long long waiting = now_ns();
 
-            produce_file_descriptor_pair(source_file, destination_file);
+            // Every copy holds its two files from the budget. With copies in flight only
+            // their completions would free descriptors, so the thread must not wait for them.
+            if (idle) {
+                acquire_fds(2);
+            } else if (!try_acquire_fds(2)) {
+                break;
+            }
+            int got = idle ? dequeue_work(&item) : try_dequeue_work(&item);
+            if (idle) {
+                stat_add(&my_stats->wait_ns, now_ns() - waiting);
+            }
+            if (!got) {
+                release_fds(2);
+                break;
+            }
+            if (done) {
+                free_job(item.job);     // interrupted: drain without copying
+                release_fds(2);
+                continue;
+            }
+            uring_start_copy(&ring, copies, free_slots[--free_count], item.job);
         }
-    }
 
-    closedir(dir);
+        // Idle and the queue reported end of work
+        if (free_count == opts.uring_depth) {
+            break;
+        }
+
+        unsigned long long copying = now_ns();
+        int entered = uring_enter(&ring, 1);
+        stat_add(&my_stats->copy_ns, now_ns() - copying);
+        if (entered == -1) {
+            fprintf(stderr, "Error submitting to io_uring: %s\n", strerror(errno));
+            uring_abandon(copies, opts.uring_depth);
+            WorkItem item;
+            while (dequeue_work(&item)) {
+                free_job(item.job);
+            }
+            break;
+        }
 
-    pthread_mutex_lock(&buf.mutex);
-    buf.done = 1;
-    pthread_cond_broadcast(&buf.not_empty);
-    pthread_mutex_unlock(&buf.mutex);
+        // Reap every completion that is ready
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            int slot = (int)(cqe->user_data >> 2);
+            if (uring_complete(&ring, copies, slot, (int)(cqe->user_data & 3), cqe->res)) {
+                free_slots[free_count++] = slot;
+                release_fds(2);
+            }
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
 
+    for (int i = 0; i < opts.uring_depth; i++) {
+        munmap(copies[i].buffer, copies[i].buffer_size);
+    }
+    free(copies);
+    free(free_slots);
+    uring_cleanup(&ring);
+    release_fds(1);
     return NULL;
 }
 
-void* consumer_thread(void* arg) {
+// Bytes copied by the consumers placed on a node
+unsigned long long node_stat(int node, int* consumers) {
+    unsigned long long bytes = 0;
+    *consumers = 0;
+    pthread_mutex_lock(&stats.mutex);
+    for (ThreadStats* thread = stats.threads; thread != NULL; thread = thread->next) {
+        if (strcmp(thread->role, "consumer") == 0 && thread->node == node) {
+            bytes += load_stat(&thread->bytes);
+            (*consumers)++;
+        }
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    return bytes;
+}
+
+// Time from a consumer's last finished item to the end of the run
+double idle_tail(ThreadStats* thread, unsigned long long end_ns) {
+    unsigned long long last = load_stat(&thread->last_done_ns);
+    return last && end_ns > last ? (end_ns - last) / 1e9 : 0;
+}
+
+void write_json_report(FILE* out, double elapsed, unsigned long long end_ns) {
+    unsigned long long files = total_stat(offsetof(ThreadStats, files));
+    unsigned long long bytes = total_stat(offsetof(ThreadStats, bytes));
+
+    fprintf(out, "{\n  \"elapsed_seconds\": %.6f,\n", elapsed);
+    fprintf(out, "  \"files\": %llu,\n  \"bytes\": %llu,\n", files, bytes);
+    fprintf(out, "  \"skipped_files\": %d,\n", atomic_load(&skipped_files));
+    fprintf(out, "  \"hole_bytes\": %llu,\n", total_stat(offsetof(ThreadStats, hole_bytes)));
+    fprintf(out, "  \"mb_per_second\": %.3f,\n", elapsed > 0 ? bytes / 1048576.0 / elapsed : 0);
+    fprintf(out, "  \"files_per_second\": %.3f,\n", elapsed > 0 ? files / elapsed : 0);
+
+    fprintf(out, "  \"consumers\": [");
+    const char* separator = "";
+    pthread_mutex_lock(&stats.mutex);
+    for (ThreadStats* thread = stats.threads; thread != NULL; thread = thread->next) {
+        if (strcmp(thread->role, "consumer") != 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    { \"id\": %d, \"files\": %llu, \"bytes\": %llu, "
+                "\"queue_wait_seconds\": %.6f, \"copy_seconds\": %.6f, \"idle_tail_seconds\": %.6f }",
+                separator, thread->id, load_stat(&thread->files), load_stat(&thread->bytes),
+                load_stat(&thread->wait_ns) / 1e9, load_stat(&thread->copy_ns) / 1e9, idle_tail(thread, end_ns));
+        separator = ",";
+    }
+    pthread_mutex_unlock(&stats.mutex);
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"batching\": { \"small_file_size\": %lld, \"batch_bytes\": %lld, \"batch_files\": %d, "
+            "\"batches\": %llu, \"batched_files\": %llu },\n",
+            (long long)opts.small_file_size, (long long)opts.batch_bytes, opts.batch_files,
+            load_stat(&stats.batches), load_stat(&stats.batched_files));
+    fprintf(out, "  \"nodes\": [");
+    separator = "";
+    for (int node = -1; node < node_count; node++) {
+        int consumers;
+        unsigned long long node_bytes = node_stat(node, &consumers);
+        if (consumers > 0) {
+            fprintf(out, "%s\n    { \"node\": %d, \"consumers\": %d, \"bytes\": %llu, \"mb_per_second\": %.3f }",
+                    separator, node, consumers, node_bytes, elapsed > 0 ? node_bytes / 1048576.0 / elapsed : 0);
+            separator = ",";
+        }
+    }
+    fprintf(out, "\n  ],\n");
+    fprintf(out, "  \"checksums\": { \"kernel\": \"%s\", \"hashed_bytes\": %llu, \"hash_seconds\": %.6f, "
+            "\"verify_seconds\": %.6f, \"verify_failures\": %d },\n",
+            opts.checksum ? crc32c_kernel : "none", total_stat(offsetof(ThreadStats, hashed_bytes)),
+            total_stat(offsetof(ThreadStats, hash_ns)) / 1e9, total_stat(offsetof(ThreadStats, verify_ns)) / 1e9,
+            atomic_load(&verify_failures));
+    fprintf(out, "  \"tuning\": { \"auto_queue\": %s, \"auto_block\": %s, \"auto_consumers\": %s, "
+            "\"queue_depth\": %zu, \"block_size\": %zu, \"consumers\": %d, "
+            "\"full_sleeps\": %llu, \"empty_sleeps\": %llu,\n",
+            opts.auto_queue ? "true" : "false", opts.auto_block ? "true" : "false",
+            opts.auto_consumers ? "true" : "false", atomic_load(&buf.limit), atomic_load(&io_block_size),
+            atomic_load(&active_consumers), load_stat(&buf.full_sleeps), load_stat(&buf.empty_sleeps));
+    fprintf(out, "    \"consumer_timeline\": [");
+    for (int i = 0; i < timeline_count; i++) {
+        fprintf(out, "%s { \"seconds\": %.3f, \"consumers\": %d, \"mb_per_second\": %.3f }",
+                i ? "," : "", timeline[i].seconds, timeline[i].consumers, timeline[i].rate);
+    }
+    fprintf(out, " ] },\n");
+
+    fprintf(out, "  \"syscalls\": {");
+    for (int kind = 0; kind < CALL_KINDS; kind++) {
+        fprintf(out, "%s \"%s\": %llu", kind ? "," : "", call_names[kind],
+                total_stat(offsetof(ThreadStats, calls) + kind * sizeof(atomic_ullong)));
+    }
+    fprintf(out, " },\n");
+
+    // Column i counts files that took less than 2^(i+1) microseconds
+    fprintf(out, "  \"latency_histogram\": {\n    \"bucket_upper_bounds_us\": [");
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        fprintf(out, "%s%llu", bucket ? ", " : "", 2ULL << bucket);
+    }
+    fprintf(out, "],\n    \"size_buckets\": [");
+    for (int size = 0; size < SIZE_BUCKETS; size++) {
+        fprintf(out, "%s\n      { \"max_size\": %lld, \"counts\": [", size ? "," : "",
+                (long long)size_bucket_limits[size]);
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            fprintf(out, "%s%llu", bucket ? ", " : "", atomic_load(&stats.latency[size][bucket]));
+        }
+        fprintf(out, "] }");
+    }
+    fprintf(out, "\n    ]\n  }\n}\n");
+}
+
+// Long-format CSV: one "metric,label,value" row per number
+void write_csv_report(FILE* out, double elapsed, unsigned long long end_ns) {
+    unsigned long long files = total_stat(offsetof(ThreadStats, files));
+    unsigned long long bytes = total_stat(offsetof(ThreadStats, bytes));
+
+    fprintf(out, "metric,label,value\n");
+    fprintf(out, "elapsed_seconds,,%.6f\n", elapsed);
+    fprintf(out, "files,,%llu\nbytes,,%llu\n", files, bytes);
+    fprintf(out, "skipped_files,,%d\n", atomic_load(&skipped_files));
+    fprintf(out, "hole_bytes,,%llu\n", total_stat(offsetof(ThreadStats, hole_bytes)));
+    fprintf(out, "mb_per_second,,%.3f\n", elapsed > 0 ? bytes / 1048576.0 / elapsed : 0);
+    fprintf(out, "files_per_second,,%.3f\n", elapsed > 0 ? files / elapsed : 0);
+
+    pthread_mutex_lock(&stats.mutex);
+    for (ThreadStats* thread = stats.threads; thread != NULL; thread = thread->next) {
+        if (strcmp(thread->role, "consumer") != 0) {
+            continue;
+        }
+        fprintf(out, "consumer_files,%d,%llu\n", thread->id, load_stat(&thread->files));
+        fprintf(out, "consumer_bytes,%d,%llu\n", thread->id, load_stat(&thread->bytes));
+        fprintf(out, "consumer_queue_wait_seconds,%d,%.6f\n", thread->id, load_stat(&thread->wait_ns) / 1e9);
+        fprintf(out, "consumer_copy_seconds,%d,%.6f\n", thread->id, load_stat(&thread->copy_ns) / 1e9);
+        fprintf(out, "consumer_idle_tail_seconds,%d,%.6f\n", thread->id, idle_tail(thread, end_ns));
+    }
+    pthread_mutex_unlock(&stats.mutex);
+
+    fprintf(out, "batching,small_file_size,%lld\n", (long long)opts.small_file_size);
+    fprintf(out, "batching,batch_bytes,%lld\n", (long long)opts.batch_bytes);
+    fprintf(out, "batching,batch_files,%d\n", opts.batch_files);
+    fprintf(out, "batching,batches,%llu\n", load_stat(&stats.batches));
+    fprintf(out, "batching,batched_files,%llu\n", load_stat(&stats.batched_files));
+    for (int node = -1; node < node_count; node++) {
+        int consumers;
+        unsigned long long node_bytes = node_stat(node, &consumers);
+        if (consumers > 0) {
+            fprintf(out, "node_consumers,%d,%d\n", node, consumers);
+            fprintf(out, "node_bytes,%d,%llu\n", node, node_bytes);
+            fprintf(out, "node_mb_per_second,%d,%.3f\n", node, elapsed > 0 ? node_bytes / 1048576.0 / elapsed : 0);
+        }
+    }
+    fprintf(out, "checksums,hashed_bytes,%llu\n", total_stat(offsetof(ThreadStats, hashed_bytes)));
+    fprintf(out, "checksums,hash_seconds,%.6f\n", total_stat(offsetof(ThreadStats, hash_ns)) / 1e9);
+    fprintf(out, "checksums,verify_seconds,%.6f\n", total_stat(offsetof(ThreadStats, verify_ns)) / 1e9);
+    fprintf(out, "checksums,verify_failures,%d\n", atomic_load(&verify_failures));
+    fprintf(out, "tuning,queue_depth,%zu\n", atomic_load(&buf.limit));
+    fprintf(out, "tuning,block_size,%zu\n", atomic_load(&io_block_size));
+    fprintf(out, "tuning,consumers,%d\n", atomic_load(&active_consumers));
+    for (int i = 0; i < timeline_count; i++) {
+        fprintf(out, "consumer_timeline,%.3f,%d\n", timeline[i].seconds, timeline[i].consumers);
+    }
+    fprintf(out, "tuning,full_sleeps,%llu\n", load_stat(&buf.full_sleeps));
+    fprintf(out, "tuning,empty_sleeps,%llu\n", load_stat(&buf.empty_sleeps));
+
+    for (int kind = 0; kind < CALL_KINDS; kind++) {
+        fprintf(out, "syscalls,%s,%llu\n", call_names[kind],
+                total_stat(offsetof(ThreadStats, calls) + kind * sizeof(atomic_ullong)));
+    }
+
+    for (int size = 0; size < SIZE_BUCKETS; size++) {
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            unsigned long long count = atomic_load(&stats.latency[size][bucket]);
+            if (count > 0) {
+                fprintf(out, "latency_files,size<=%lld;us<%llu,%llu\n",
+                        (long long)size_bucket_limits[size], 2ULL << bucket, count);
+            }
+        }
+    }
+}
+
+void write_stats_report(double elapsed, unsigned long long end_ns) {
+    FILE* out = stdout;
+    if (opts.stats_file != NULL && (out = fopen(opts.stats_file, "w")) == NULL) {
+        fprintf(stderr, "Error opening stats file %s: %s\n", opts.stats_file, strerror(errno));
+        return;
+    }
+
+    if (opts.stats_format == STATS_JSON) {
+        write_json_report(out, elapsed, end_ns);
+    } else {
+        write_csv_report(out, elapsed, end_ns);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+// Prints a progress line every opts.progress_interval seconds until the copy finishes
+pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progress_done = PTHREAD_COND_INITIALIZER;
+int copy_finished = 0;
+
+void* progress_thread(void* arg) {
+    unsigned long long start = now_ns();
+    unsigned long long last_bytes = 0;
     (void)arg; // Unused parameter
-    while (1) {
-        consume_file_descriptor_pair();
 
-        pthread_mutex_lock(&buf.mutex);
-        if (buf.count == 0 && buf.done) {
-            pthread_mutex_unlock(&buf.mutex);
-            break;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&progress_mutex);
+    while (!copy_finished) {
+        deadline.tv_sec += opts.progress_interval;
+        if (pthread_cond_timedwait(&progress_done, &progress_mutex, &deadline) != ETIMEDOUT) {
+            continue;
         }
-        pthread_mutex_unlock(&buf.mutex);
+
+        unsigned long long files = total_stat(offsetof(ThreadStats, files));
+        unsigned long long bytes = total_stat(offsetof(ThreadStats, bytes));
+        size_t queued = atomic_load(&buf.enqueue_pos) - atomic_load(&buf.dequeue_pos);
+        fprintf(stderr, "Progress: %.1fs %llu files %.1f MB (%.1f MB/s now) queue %zu/%zu\n",
+                (now_ns() - start) / 1e9, files, bytes / 1048576.0,
+                (bytes - last_bytes) / 1048576.0 / opts.progress_interval, queued, atomic_load(&buf.limit));
+        last_bytes = bytes;
     }
+    pthread_mutex_unlock(&progress_mutex);
+    return NULL;
+}
+
+// Auto mode: every TUNE_INTERVAL_MS look at throughput and queue behaviour and adjust
+// the queue depth, block size and consumer count. The queue grows when producers hit
+// a full queue in the same interval consumers found it empty (bursty supply), and
+// shrinks after a run of intervals where it stayed mostly unused. The block size
+// hill-climbs on MB/s. The consumer count climbs while each step up raises MB/s,
+// undoes a step that did not, and backs off when MB/s falls or items slow down.
+void* tuner_thread(void* arg) {
+    unsigned long long last_bytes = 0;
+    unsigned long long last_full = 0;
+    unsigned long long last_empty = 0;
+    double last_rate = 0;
+    int direction = 1;
+    int quiet_intervals = 0;
+    (void)arg; // Unused parameter
+
+    // Consumer scaling state, sampled every SCALE_INTERVALS
+    unsigned long long started = now_ns();
+    unsigned long long scale_bytes = 0;
+    unsigned long long scale_copy_ns = 0;
+    unsigned long long scale_items = 0;
+    unsigned long long scale_empty = 0;
+    double scale_rate = 0;          // MB/s of the last decision interval, 0 for none yet
+    double scale_latency = 0;       // mean ns per item in that interval
+    int previous = atomic_load(&active_consumers);     // count before the step being judged
+    int intervals = 0;
+    int hold = 0;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+
+    pthread_mutex_lock(&progress_mutex);
+    while (!copy_finished) {
+        deadline.tv_nsec += TUNE_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&progress_done, &progress_mutex, &deadline) != ETIMEDOUT) {
+            continue;
+        }
 
+        unsigned long long bytes = total_stat(offsetof(ThreadStats, bytes));
+        unsigned long long full = atomic_load(&buf.full_sleeps);
+        unsigned long long empty = atomic_load(&buf.empty_sleeps);
+        double rate = (bytes - last_bytes) / 1048576.0 / (TUNE_INTERVAL_MS / 1000.0);
+        size_t limit = atomic_load(&buf.limit);
+        size_t queued = atomic_load(&buf.enqueue_pos) - atomic_load(&buf.dequeue_pos);
+
+        if (opts.auto_queue) {
+            size_t next = limit;
+            if (full > last_full && empty > last_empty && limit < buf.capacity) {
+                next = limit * 2 < buf.capacity ? limit * 2 : buf.capacity;
+                quiet_intervals = 0;
+            } else if (full == last_full && queued * 4 < limit && limit > 4) {
+                if (++quiet_intervals >= 4) {
+                    next = limit / 2;
+                    quiet_intervals = 0;
+                }
+            } else {
+                quiet_intervals = 0;
+            }
+
+            if (next != limit) {
+                fprintf(stderr, "Tuner: queue depth %zu -> %zu\n", limit, next);
+                atomic_store(&buf.limit, next);
+                // Producers sleeping on the old limit may now fit
+                atomic_fetch_add(&buf.not_full, 1);
+                futex_wake(&buf.not_full, INT_MAX);
+            }
+        }
+
+        // Only tune the block size while consumers are kept busy; a starved interval
+        // measures the scanner, not the copy path
+        if (opts.auto_block && bytes > last_bytes && empty == last_empty) {
+            if (last_rate > 0 && rate < last_rate * 0.95) {
+                direction = -direction;
+            }
+            size_t block = atomic_load(&io_block_size);
+            size_t next = direction > 0 ? block * 2 : block / 2;
+            if (next < MIN_BLOCK_SIZE || next > MAX_BLOCK_SIZE) {
+                direction = -direction;
+                next = block;
+            }
+            if (next != block) {
+                fprintf(stderr, "Tuner: block size %zu KB -> %zu KB (%.1f MB/s)\n", block >> 10, next >> 10, rate);
+                atomic_store(&io_block_size, next);
+            }
+            last_rate = rate;
+        }
+
+        if (opts.auto_consumers && ++intervals == SCALE_INTERVALS) {
+            unsigned long long copy_ns = total_stat(offsetof(ThreadStats, copy_ns));
+            unsigned long long items = total_stat(offsetof(ThreadStats, items));
+            double interval_rate = (bytes - scale_bytes) / 1048576.0 / (SCALE_INTERVALS * TUNE_INTERVAL_MS / 1000.0);
+            double latency = items > scale_items ? (double)(copy_ns - scale_copy_ns) / (items - scale_items) : 0;
+            int active = atomic_load(&active_consumers);
+            int next = active;
+            int step = active / 2 > 1 ? active / 2 : 1;
+
+            if (items == scale_items || empty > scale_empty) {
+                // Idle, or consumers waited for work: the producer sets the pace, not them
+                scale_rate = 0;
+            } else if (scale_rate == 0) {
+                // First busy interval at this count: just take it as the baseline
+            } else if (previous < active) {
+                if (interval_rate < scale_rate * 1.05 || latency > scale_latency * 1.5) {
+                    next = previous;    // the extra consumers did not pay off
+                }
+            } else if (previous > active) {
+                if (interval_rate < scale_rate * 0.95) {
+                    next = previous;    // backing off cost throughput
+                }
+            } else if (interval_rate < scale_rate * 0.8 ||
+                       (latency > scale_latency * 1.5 && interval_rate <= scale_rate)) {
+                next = active - (active / 4 > 1 ? active / 4 : 1);
+                next = next < 1 ? 1 : next;
+            } else if (hold > 0) {
+                hold--;
+            } else {
+                next = active + step < MAX_AUTO_CONSUMERS ? active + step : MAX_AUTO_CONSUMERS;
+            }
+
+            int undo = next == previous && next != active;
+            if (next != active) {
+                fprintf(stderr, "Tuner: consumers %d -> %d (%.1f MB/s, %.2f ms per item)\n",
+                        active, next, interval_rate, latency / 1e6);
+                if (timeline_count < MAX_TIMELINE) {
+                    timeline[timeline_count++] = (ScaleStep){ (now_ns() - started) / 1e9, next, interval_rate };
+                }
+                set_active_consumers(next);
+            }
+            // A reverted step is not judged again; the next interval is a fresh baseline
+            previous = undo ? next : active;
+            if (undo) {
+                hold = SCALE_HOLD;
+                scale_rate = 0;
+            } else if (items > scale_items && empty == scale_empty) {
+                scale_rate = interval_rate;
+                scale_latency = latency;
+            }
+
+            scale_bytes = bytes;
+            scale_copy_ns = copy_ns;
+            scale_items = items;
+            scale_empty = empty;
+            intervals = 0;
+        }
+
+        last_bytes = bytes;
+        last_full = full;
+        last_empty = empty;
+    }
+    pthread_mutex_unlock(&progress_mutex);
     return NULL;
 }
 
 void handle_signal(int signal)
 {
-    if (signal == SIGINT) {
-        fprintf(stderr, "Received SIGINT signal. Terminating...\n");
+    if (signal == SIGINT && !done) {
+        const char message[] = "Received SIGINT signal. Terminating...\n";
+        if (write(STDERR_FILENO, message, sizeof(message) - 1) == -1) {
+            // Nothing more to do from a signal handler
+        }
         done = 1;
+        // The list reader may be blocked reading a slow upstream; the signal
+        // interrupts that read only if it is delivered to the reader itself
+        if (list_reading && !pthread_equal(pthread_self(), list_tid)) {
+            pthread_kill(list_tid, SIGINT);
+        }
+    }
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options] <buffer size> <number of consumers> <source directory> <destination directory>\n", program);
+    fprintf(stderr, "       %s --files-from=FILE --pairs [options] <buffer size> <number of consumers>\n", program);
+    fprintf(stderr, "  <buffer size> is the work queue depth, or auto to tune it while copying\n");
+    fprintf(stderr, "  <number of consumers> is a thread count, or auto to add and park consumers while copying\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -c, --chunk-size=SIZE   split files larger than SIZE (K/M/G) into ranges copied in parallel\n");
+    fprintf(stderr, "  -m, --copy-method=NAME  first backend to try: auto, copy_file_range, sendfile, splice or rw\n");
+    fprintf(stderr, "      --block-size=SIZE   bytes per read/write or splice call, or auto to tune it (default 1M)\n");
+    fprintf(stderr, "      --stream[=MODE]     keep the copy out of the page cache: direct (O_DIRECT, default) or fadvise\n");
+    fprintf(stderr, "      --preallocate       fallocate each destination to its source size before copying\n");
+    fprintf(stderr, "      --sync=MODE         none (default), file (fdatasync each file) or group[:N] (background group commit)\n");
+    fprintf(stderr, "      --checksum          CRC32C every file while it is in the copy buffer\n");
+    fprintf(stderr, "      --verify            with --checksum, re-read each destination and compare\n");
+    fprintf(stderr, "      --checksum-file=FILE  write \"crc32c  path\" lines for copied files to FILE\n");
+    fprintf(stderr, "      --journal=FILE      record completed files and ranges in FILE as the copy goes\n");
+    fprintf(stderr, "      --resume            with --journal, skip the work it records and continue partial files\n");
+    fprintf(stderr, "      --cpus=LIST         pin consumer i to the i-th CPU of LIST (e.g. 0-3,8-11)\n");
+    fprintf(stderr, "      --numa=MODE         spread consumers over nodes, or put them on the node nearest\n");
+    fprintf(stderr, "                          the source or destination device\n");
+    fprintf(stderr, "      --files-from=FILE   copy the NUL-separated paths (relative to the source directory) in FILE,\n");
+    fprintf(stderr, "                          or - for stdin, starting while the list is still being written\n");
+    fprintf(stderr, "      --pairs             --files-from entries alternate source and destination paths\n");
+    fprintf(stderr, "      --include=GLOB      copy only files matching GLOB (repeatable)\n");
+    fprintf(stderr, "      --exclude=GLOB      skip files and directories matching GLOB (repeatable); a GLOB\n");
+    fprintf(stderr, "                          with '/' matches the relative path, any other the file name\n");
+    fprintf(stderr, "  -s, --scanners=N        threads scanning the source tree (default 4)\n");
+    fprintf(stderr, "  -e, --engine=NAME       threads (default) or uring to drive all copies from one io_uring thread\n");
+    fprintf(stderr, "      --uring-depth=N     copies the io_uring engine keeps in flight (default 64)\n");
+    fprintf(stderr, "  -i, --incremental       skip files whose size and mtime match the destination or manifest\n");
+    fprintf(stderr, "      --hash-check        with --incremental, also require matching content hashes\n");
+    fprintf(stderr, "      --manifest=FILE     read the previous run's manifest from FILE and write this run's to it\n");
+    fprintf(stderr, "      --small-file=SIZE   batch files up to SIZE into shared work items (default 64K)\n");
+    fprintf(stderr, "      --batch-bytes=SIZE  queue a batch once it holds SIZE bytes (default 1M)\n");
+    fprintf(stderr, "      --batch-files=N     queue a batch once it holds N files (default 64, 1 disables)\n");
+    fprintf(stderr, "      --sparse            copy only data extents (SEEK_DATA/SEEK_HOLE) and keep holes\n");
+    fprintf(stderr, "      --schedule=MODE     fifo (default), largest (pre-scan, largest first) or window:N\n");
+    fprintf(stderr, "      --max-fds=N         descriptors pCp may hold open (default: RLIMIT_NOFILE minus a reserve)\n");
+    fprintf(stderr, "      --stats=FORMAT      write a json or csv run report at exit\n");
+    fprintf(stderr, "      --stats-file=FILE   write the report to FILE instead of stdout\n");
+    fprintf(stderr, "  -p, --progress=SECONDS  print a progress line to stderr every SECONDS\n");
+}
+
+// Map a --copy-method name to the backend the fallback chain starts from
+int parse_copy_method(const char* name) {
+    if (strcmp(name, "auto") == 0) {
+        return COPY_FILE_RANGE;
+    }
+    if (strcmp(name, "rw") == 0) {
+        return COPY_READ_WRITE;
     }
+    for (int i = 0; i < COPY_METHODS; i++) {
+        if (strcmp(name, copy_method_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 5) {
-        fprintf(stderr, "Usage: %s <buffer size> <number of consumers> <source directory> <destination directory>\n", argv[0]);
+    static struct option long_options[] = {
+        { "chunk-size", required_argument, NULL, 'c' },
+        { "copy-method", required_argument, NULL, 'm' },
+        { "scanners", required_argument, NULL, 's' },
+        { "engine", required_argument, NULL, 'e' },
+        { "uring-depth", required_argument, NULL, 'U' },
+        { "incremental", no_argument, NULL, 'i' },
+        { "hash-check", no_argument, NULL, 'H' },
+        { "manifest", required_argument, NULL, 'M' },
+        { "stats", required_argument, NULL, 'S' },
+        { "sparse", no_argument, NULL, 'P' },
+        { "schedule", required_argument, NULL, 'W' },
+        { "max-fds", required_argument, NULL, 'O' },
+        { "block-size", required_argument, NULL, 'K' },
+        { "stream", optional_argument, NULL, 'D' },
+        { "preallocate", no_argument, NULL, 'A' },
+        { "sync", required_argument, NULL, 'Y' },
+        { "checksum", no_argument, NULL, 'X' },
+        { "verify", no_argument, NULL, 'V' },
+        { "checksum-file", required_argument, NULL, 'Q' },
+        { "journal", required_argument, NULL, 'J' },
+        { "cpus", required_argument, NULL, 'G' },
+        { "numa", required_argument, NULL, 'T' },
+        { "resume", no_argument, NULL, 'R' },
+        { "files-from", required_argument, NULL, 'L' },
+        { "pairs", no_argument, NULL, '2' },
+        { "include", required_argument, NULL, 'I' },
+        { "exclude", required_argument, NULL, 'E' },
+        { "small-file", required_argument, NULL, 'z' },
+        { "batch-bytes", required_argument, NULL, 'B' },
+        { "batch-files", required_argument, NULL, 'N' },
+        { "stats-file", required_argument, NULL, 'F' },
+        { "progress", required_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:m:s:e:ip:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                opts.chunk_size = parse_size(optarg);
+                if (opts.chunk_size < 0) {
+                    fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm': {
+                int method = parse_copy_method(optarg);
+                if (method < 0) {
+                    fprintf(stderr, "Invalid copy method: %s\n", optarg);
+                    return 1;
+                }
+                opts.copy_method = method;
+                break;
+            }
+            case 's':
+                opts.scanners = atoi(optarg);
+                if (opts.scanners < 1) {
+                    fprintf(stderr, "Invalid number of scanners: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "threads") == 0) {
+                    opts.engine = ENGINE_THREADS;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    opts.engine = ENGINE_URING;
+                } else {
+                    fprintf(stderr, "Invalid engine: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'U':
+                opts.uring_depth = atoi(optarg);
+                if (opts.uring_depth < 1) {
+                    fprintf(stderr, "Invalid io_uring depth: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                opts.incremental = 1;
+                break;
+            case 'H':
+                opts.hash_check = 1;
+                break;
+            case 'M':
+                opts.manifest_file = optarg;
+                break;
+            case 'S':
+                if (strcmp(optarg, "json") == 0) {
+                    opts.stats_format = STATS_JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    opts.stats_format = STATS_CSV;
+                } else {
+                    fprintf(stderr, "Invalid stats format: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                opts.stats_file = optarg;
+                break;
+            case 'p':
+                opts.progress_interval = atoi(optarg);
+                if (opts.progress_interval < 1) {
+                    fprintf(stderr, "Invalid progress interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'z':
+            case 'B': {
+                off_t size = parse_size(optarg);
+                if (size < 0) {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    return 1;
+                }
+                *(opt == 'z' ? &opts.small_file_size : &opts.batch_bytes) = size;
+                break;
+            }
+            case 'N':
+                opts.batch_files = atoi(optarg);
+                if (opts.batch_files < 1) {
+                    fprintf(stderr, "Invalid batch file count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                opts.sparse = 1;
+                break;
+            case 'W':
+                if (strcmp(optarg, "fifo") == 0) {
+                    opts.schedule = SCHEDULE_FIFO;
+                } else if (strcmp(optarg, "largest") == 0) {
+                    opts.schedule = SCHEDULE_LARGEST;
+                } else if (strncmp(optarg, "window:", 7) == 0 && atoi(optarg + 7) > 0) {
+                    opts.schedule = SCHEDULE_WINDOW;
+                    opts.schedule_window = atoi(optarg + 7);
+                } else {
+                    fprintf(stderr, "Invalid schedule: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                opts.max_fds = atoi(optarg);
+                if (opts.max_fds < 8) {
+                    fprintf(stderr, "Invalid descriptor budget (minimum 8): %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'K':
+                if (strcmp(optarg, "auto") == 0) {
+                    opts.auto_block = 1;
+                    break;
+                }
+                opts.block_size = parse_size(optarg);
+                if (opts.block_size < 4096 || opts.block_size > MAX_BLOCK_SIZE) {
+                    fprintf(stderr, "Invalid block size (4K to 8M): %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (optarg == NULL || strcmp(optarg, "direct") == 0) {
+                    opts.stream = STREAM_DIRECT;
+                } else if (strcmp(optarg, "fadvise") == 0) {
+                    opts.stream = STREAM_FADVISE;
+                } else {
+                    fprintf(stderr, "Invalid stream mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'A':
+                opts.preallocate = 1;
+                break;
+            case 'Y':
+                if (strcmp(optarg, "none") == 0) {
+                    opts.sync = SYNC_NONE;
+                } else if (strcmp(optarg, "file") == 0) {
+                    opts.sync = SYNC_FILE;
+                } else if (strcmp(optarg, "group") == 0) {
+                    opts.sync = SYNC_GROUP;
+                } else if (strncmp(optarg, "group:", 6) == 0 && atoi(optarg + 6) > 0) {
+                    opts.sync = SYNC_GROUP;
+                    opts.sync_group = atoi(optarg + 6);
+                } else {
+                    fprintf(stderr, "Invalid sync mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'X':
+                opts.checksum = 1;
+                break;
+            case 'V':
+                opts.checksum = 1;
+                opts.verify = 1;
+                break;
+            case 'Q':
+                opts.checksum = 1;
+                opts.checksum_file = optarg;
+                break;
+            case 'J':
+                opts.journal_file = optarg;
+                break;
+            case 'R':
+                opts.resume = 1;
+                break;
+            case 'L':
+                opts.files_from = optarg;
+                break;
+            case '2':
+                opts.pairs = 1;
+                break;
+            case 'I':
+            case 'E': {
+                const char*** patterns = opt == 'I' ? &opts.includes : &opts.excludes;
+                int* count = opt == 'I' ? &opts.include_count : &opts.exclude_count;
+                if (*patterns == NULL) {
+                    *patterns = malloc(argc * sizeof(char*));
+                }
+                (*patterns)[(*count)++] = optarg;
+                break;
+            }
+            case 'G':
+                opts.cpus = malloc(CPU_SETSIZE * sizeof(int));
+                opts.cpu_count = parse_cpu_list(optarg, opts.cpus, CPU_SETSIZE);
+                if (opts.cpu_count < 1 || opts.cpus[opts.cpu_count - 1] >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                    return 1;
+                }
+                opts.placement = PLACE_CPUS;
+                break;
+            case 'T':
+                if (strcmp(optarg, "spread") == 0) {
+                    opts.placement = PLACE_SPREAD;
+                } else if (strcmp(optarg, "source") == 0) {
+                    opts.placement = PLACE_SOURCE;
+                } else if (strcmp(optarg, "destination") == 0) {
+                    opts.placement = PLACE_DESTINATION;
+                } else {
+                    fprintf(stderr, "Invalid NUMA placement: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // With --pairs the list names every path, so the directories may be left out
+    if (opts.pairs && opts.files_from == NULL) {
+        fprintf(stderr, "--pairs needs --files-from=FILE\n");
+        return 1;
+    }
+    if (argc - optind < (opts.pairs ? 2 : 4)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.sparse && opts.engine == ENGINE_URING) {
+        fprintf(stderr, "--sparse is not supported with the io_uring engine\n");
+        return 1;
+    }
+    if (opts.stream != STREAM_OFF) {
+        if (opts.engine == ENGINE_URING) {
+            fprintf(stderr, "--stream is not supported with the io_uring engine\n");
+            return 1;
+        }
+        // O_DIRECT needs every range and block to start on an aligned offset
+        opts.chunk_size = (opts.chunk_size + DIRECT_ALIGN - 1) & ~(off_t)(DIRECT_ALIGN - 1);
+        opts.block_size = (opts.block_size + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+    }
+
+    if (strcmp(argv[optind], "auto") == 0) {
+        opts.auto_queue = 1;
+        opts.queue_depth = 16;
+    } else if (atoi(argv[optind]) < 1) {
+        fprintf(stderr, "Invalid buffer size: %s\n", argv[optind]);
+        return 1;
+    } else {
+        opts.queue_depth = atoi(argv[optind]);
+    }
+    atomic_init(&io_block_size, opts.auto_block ? DEFAULT_BLOCK_SIZE : opts.block_size);
+
+    int num_consumers;
+    if (strcmp(argv[optind + 1], "auto") == 0) {
+        // Every consumer the pool may grow to is started now and parked until needed
+        opts.auto_consumers = 1;
+        num_consumers = MAX_AUTO_CONSUMERS;
+    } else if ((num_consumers = atoi(argv[optind + 1])) < 1) {
+        fprintf(stderr, "Invalid number of consumers: %s\n", argv[optind + 1]);
+        return 1;
+    }
+    char* source_dir = argc - optind > 2 ? argv[optind + 2] : "";
+    char* destination_dir = argc - optind > 3 ? argv[optind + 3] : ".";
+
+    if (opts.resume && opts.journal_file == NULL) {
+        fprintf(stderr, "--resume needs --journal=FILE\n");
         return 1;
     }
 
-    int num_consumers = atoi(argv[2]);
-    char* source_dir = argv[3];
-    char* destination_dir = argv[4];
+    init_crc32c();
+    load_topology();
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int i = 0; i < opts.cpu_count; i++) {
+        if (!CPU_ISSET(opts.cpus[i], &allowed)) {
+            fprintf(stderr, "CPU %d is not available to pCp\n", opts.cpus[i]);
+            return 1;
+        }
+    }
+    if (opts.placement == PLACE_SOURCE || opts.placement == PLACE_DESTINATION) {
+        const char* device_path = opts.placement == PLACE_SOURCE ? source_dir : destination_dir;
+        // The destination may not exist yet; its parent is on the same device then
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", device_path);
+        struct stat st;
+        while (stat(parent, &st) == -1 && strrchr(parent, '/') != NULL) {
+            *strrchr(parent, '/') = '\0';
+        }
+        device_node = device_numa_node(parent[0] != '\0' ? parent : "/");
+        if (device_node < 0) {
+            fprintf(stderr, "NUMA node of %s is unknown, spreading consumers instead\n", device_path);
+        }
+    }
+    if (opts.files_from != NULL) {
+        list_fd = strcmp(opts.files_from, "-") == 0 ? STDIN_FILENO : open(opts.files_from, O_RDONLY | O_CLOEXEC);
+        if (list_fd == -1) {
+            fprintf(stderr, "Error opening file list %s: %s\n", opts.files_from, strerror(errno));
+            return 1;
+        }
+    }
+    if (opts.checksum_file != NULL && (checksum_out = fopen(opts.checksum_file, "w")) == NULL) {
+        fprintf(stderr, "Error opening checksum file %s: %s\n", opts.checksum_file, strerror(errno));
+        return 1;
+    }
 
     // Initialize buffer
     init_buffer();
+    init_fd_budget();
+
+    source_root = source_dir;
+    pthread_mutex_init(&next_manifest.mutex, NULL);
+    if (opts.manifest_file != NULL && load_manifest(&previous_manifest, opts.manifest_file) == -1) {
+        fprintf(stderr, "Error reading manifest %s: %s\n", opts.manifest_file, strerror(errno));
+        return 1;
+    }
+
+    if (opts.journal_file != NULL && open_journal() == -1) {
+        fprintf(stderr, "Error opening journal %s: %s\n", opts.journal_file, strerror(errno));
+        return 1;
+    }
+    pthread_t journal_tid;
+    if (journal.fd != -1) {
+        pthread_create(&journal_tid, NULL, journal_thread, NULL);
+    }
+    // No SA_RESTART: a read blocked on the --files-from list must fail with EINTR
+    struct sigaction action = { .sa_handler = handle_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+
+    pthread_t sync_tid;
+    if (opts.sync == SYNC_GROUP) {
+        pthread_create(&sync_tid, NULL, sync_thread, NULL);
+    }
 
     // Create producer thread
     pthread_t producer_tid;
     char* directories[] = { source_dir, destination_dir };
-    pthread_create(&producer_tid, NULL, producer_thread, directories);
+    pthread_create(&producer_tid, NULL, opts.files_from != NULL ? list_thread : producer_thread, directories);
+
+    // Create consumer threads; the io_uring engine needs only one
+    void* (*consumer)(void*) = consumer_thread;
+    if (opts.engine == ENGINE_URING) {
+        consumer = uring_thread;
+        num_consumers = 1;
+        opts.auto_consumers = 0;
+    }
+    atomic_init(&active_consumers, opts.auto_consumers ? AUTO_CONSUMERS : num_consumers);
 
-    // Create consumer threads
     pthread_t consumer_tids[num_consumers];
     for (int i = 0; i < num_consumers; i++) {
-        pthread_create(&consumer_tids[i], NULL, consumer_thread, NULL);
+        pthread_create(&consumer_tids[i], NULL, consumer, (void*)(long)i);
     }
 
     // Get start time
     struct timeval start_time;
     gettimeofday(&start_time, NULL);
 
+    pthread_t progress_tid;
+    if (opts.progress_interval > 0) {
+        pthread_create(&progress_tid, NULL, progress_thread, NULL);
+    }
+    pthread_t tuner_tid;
+    int tuning = opts.auto_queue || opts.auto_block || opts.auto_consumers;
+    if (tuning) {
+        pthread_create(&tuner_tid, NULL, tuner_thread, NULL);
+    }
+
     // Wait for producer thread to finish
     pthread_join(producer_tid, NULL);
 
@@ -217,9 +4427,39 @@ int main(int argc, char* argv[]) {
         pthread_join(consumer_tids[i], NULL);
     }
 
+    // Files are only durable once the last group is committed
+    if (opts.sync == SYNC_GROUP) {
+        pthread_mutex_lock(&sync_queue.mutex);
+        sync_queue.done = 1;
+        pthread_cond_signal(&sync_queue.ready);
+        pthread_mutex_unlock(&sync_queue.mutex);
+        pthread_join(sync_tid, NULL);
+    }
+
+    if (journal.fd != -1) {
+        pthread_mutex_lock(&journal.mutex);
+        journal.done = 1;
+        pthread_cond_signal(&journal.wake);
+        pthread_mutex_unlock(&journal.mutex);
+        pthread_join(journal_tid, NULL);
+        journal_flush();
+    }
+
     // Get end time
     struct timeval end_time;
     gettimeofday(&end_time, NULL);
+    unsigned long long end_ns = now_ns();
+
+    pthread_mutex_lock(&progress_mutex);
+    copy_finished = 1;
+    pthread_cond_broadcast(&progress_done);
+    pthread_mutex_unlock(&progress_mutex);
+    if (opts.progress_interval > 0) {
+        pthread_join(progress_tid, NULL);
+    }
+    if (tuning) {
+        pthread_join(tuner_tid, NULL);
+    }
 
     // Calculate total time
     double start_seconds = start_time.tv_sec + start_time.tv_usec / 1000000.0;
@@ -228,9 +4468,97 @@ int main(int argc, char* argv[]) {
 
     printf("Total time: %.2f seconds\n", total_time);
 
-    // Cleanup buffer
-    cleanup_buffer();
+    unsigned long long files = total_stat(offsetof(ThreadStats, files));
+    unsigned long long bytes = total_stat(offsetof(ThreadStats, bytes));
+    printf("Copied %llu files, %.2f MB (%.2f MB/s, %.1f files/s)\n", files, bytes / 1048576.0,
+           total_time > 0 ? bytes / 1048576.0 / total_time : 0, total_time > 0 ? files / total_time : 0);
 
-    return 0;
+    // Consumers that went idle long before the end point at a poorly balanced schedule
+    printf("Idle tail per consumer (s):");
+    for (ThreadStats* thread = stats.threads; thread != NULL; thread = thread->next) {
+        if (strcmp(thread->role, "consumer") == 0) {
+            printf(" %d:%.2f", thread->id, idle_tail(thread, end_ns));
+        }
+    }
+    printf("\n");
+    if (opts.incremental) {
+        printf("Skipped unchanged files: %d\n", atomic_load(&skipped_files));
+    }
+    if (opts.sparse) {
+        printf("Skipped hole bytes: %llu\n", total_stat(offsetof(ThreadStats, hole_bytes)));
+    }
+    if (opts.placement != PLACE_NONE) {
+        printf("Per-node throughput:");
+        for (int node = 0; node < node_count; node++) {
+            int consumers;
+            unsigned long long node_bytes = node_stat(node, &consumers);
+            if (consumers > 0) {
+                printf(" node %d: %.2f MB/s over %d consumer%s;", node,
+                       total_time > 0 ? node_bytes / 1048576.0 / total_time : 0, consumers, consumers == 1 ? "" : "s");
+            }
+        }
+        printf("\n");
+    }
+    if (opts.checksum) {
+        unsigned long long hashed = total_stat(offsetof(ThreadStats, hashed_bytes));
+        double hash_seconds = total_stat(offsetof(ThreadStats, hash_ns)) / 1e9;
+        printf("Checksums: crc32c (%s), %.2f MB hashed in %.3f s (%.1f MB/s)\n", crc32c_kernel,
+               hashed / 1048576.0, hash_seconds, hash_seconds > 0 ? hashed / 1048576.0 / hash_seconds : 0);
+    }
+    if (opts.verify) {
+        printf("Verified: %d failures, %.3f s re-reading\n", atomic_load(&verify_failures),
+               total_stat(offsetof(ThreadStats, verify_ns)) / 1e9);
+    }
+    if (opts.sync == SYNC_GROUP) {
+        printf("Group commits: %llu files in %llu groups\n", sync_queue.files, sync_queue.groups);
+    }
+    if (opts.auto_consumers) {
+        printf("Consumer timeline: 0.0s:%d", AUTO_CONSUMERS);
+        for (int i = 0; i < timeline_count; i++) {
+            printf(" %.1fs:%d", timeline[i].seconds, timeline[i].consumers);
+        }
+        printf("\n");
+    }
+    printf("Final settings: queue depth %zu%s, block size %zu KB%s, %d consumer%s%s\n",
+           atomic_load(&buf.limit), opts.auto_queue ? " (auto)" : "",
+           atomic_load(&io_block_size) >> 10, opts.auto_block ? " (auto)" : "",
+           atomic_load(&active_consumers), atomic_load(&active_consumers) == 1 ? "" : "s",
+           opts.auto_consumers ? " (auto)" : "");
+
+    if (opts.manifest_file != NULL && save_manifest(&next_manifest, opts.manifest_file) == -1) {
+        fprintf(stderr, "Error writing manifest %s: %s\n", opts.manifest_file, strerror(errno));
+    }
+    if (opts.stats_format != STATS_NONE) {
+        write_stats_report(total_time, end_ns);
+    }
+
+    if (opts.resume) {
+        printf("Resumed: %d files already complete, %d partial files continued\n",
+               atomic_load(&resumed_files), atomic_load(&continued_files));
+    }
+    if (journal.fd != -1) {
+        close_journal();
+    }
+    if (done) {
+        fprintf(stderr, opts.journal_file != NULL ? "Interrupted; run again with --resume to continue\n"
+                                                  : "Interrupted; use --journal to make copies resumable\n");
+    }
+
+    if (checksum_out != NULL) {
+        fclose(checksum_out);
+    }
+    if (list_fd > STDIN_FILENO) {
+        close(list_fd);
+    }
+    free(opts.includes);
+    free(opts.excludes);
+    free_manifest(&previous_manifest);
+    free_manifest(&next_manifest);
+    free(buf.slots);
+
+    if (done) {
+        return 130;
+    }
+    return atomic_load(&verify_failures) > 0 ? 1 : 0;
 }
 
@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Benchmarks for pCp. "residency" reports how much of a tree sits in the page cache;
+// "cache" runs a copy command and shows what it did to the page cache: a warmed
+// victim tree standing in for a co-located service, and the copy's own source and
+// destination. "generate" writes reproducible source trees and "sweep" runs pCp over
+// a grid of settings, appending one CSV row per run.
+
+#define MAX_GRID 16
+
+typedef struct {
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned long long pages;
+    unsigned long long resident;
+} Residency;
+
+long page_size;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Count the resident pages of one file with mincore
+void file_residency(const char* path, off_t size, Residency* total) {
+    total->files++;
+    total->bytes += size;
+    if (size == 0) {
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping file %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    size_t pages = (size + page_size - 1) / page_size;
+    unsigned char* vector = malloc(pages);
+    if (mincore(map, size, vector) == 0) {
+        for (size_t i = 0; i < pages; i++) {
+            total->resident += vector[i] & 1;
+        }
+        total->pages += pages;
+    }
+    free(vector);
+    munmap(map, size);
+}
+
+// Walk a tree and apply an action to every regular file
+void walk_tree(const char* path, void (*action)(const char*, off_t, Residency*), Residency* total) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        action(path, st.st_size, total);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return;
+    }
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening directory %s: %s\n", path, strerror(errno));
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+        walk_tree(child, action, total);
+    }
+    closedir(dir);
+}
+
+// Read a file end to end so it is cached, as a busy service's working set would be
+void warm_file(const char* path, off_t size, Residency* total) {
+    (void)size; // Unused parameter
+    (void)total;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    static char block[1 << 16];
+    while (read(fd, block, sizeof(block)) > 0) {
+    }
+    close(fd);
+}
+
+// Push a file out of the cache so every run starts from the same state
+void evict_file(const char* path, off_t size, Residency* total) {
+    (void)size; // Unused parameter
+    (void)total;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Count files and bytes without touching their contents
+void count_file(const char* path, off_t size, Residency* total) {
+    (void)path; // Unused parameter
+    total->files++;
+    total->bytes += size;
+}
+
+Residency measure(const char* path) {
+    Residency total = { 0, 0, 0, 0 };
+    walk_tree(path, file_residency, &total);
+    return total;
+}
+
+// Page cache size from /proc/meminfo, in kB
+long long cached_kb() {
+    FILE* meminfo = fopen("/proc/meminfo", "r");
+    if (meminfo == NULL) {
+        return -1;
+    }
+    char line[256];
+    long long kb = -1;
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "Cached: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return kb;
+}
+
+void print_residency(const char* label, const char* path, Residency before, Residency after) {
+    printf("%-12s %8.1f MB %6.1f%% -> %8.1f MB %6.1f%%   (%s)\n", label,
+           before.resident * page_size / 1048576.0, before.pages ? 100.0 * before.resident / before.pages : 0,
+           after.resident * page_size / 1048576.0, after.pages ? 100.0 * after.resident / after.pages : 0, path);
+}
+
+int residency_command(int argc, char* argv[]) {
+    for (int i = 0; i < argc; i++) {
+        Residency total = measure(argv[i]);
+        printf("%s: %llu files, %.1f of %.1f MB resident (%.1f%%)\n", argv[i], total.files,
+               total.resident * page_size / 1048576.0, total.pages * page_size / 1048576.0,
+               total.pages ? 100.0 * total.resident / total.pages : 0);
+    }
+    return 0;
+}
+
+// cache <victim dir> <source dir> <destination dir> -- <command...>
+int cache_command(int argc, char* argv[]) {
+    if (argc < 5 || strcmp(argv[3], "--") != 0) {
+        fprintf(stderr, "Usage: pCpBench cache <victim dir> <source dir> <destination dir> -- <command...>\n");
+        return 1;
+    }
+    const char* victim = argv[0];
+    const char* source = argv[1];
+    const char* destination = argv[2];
+
+    // Cold source, warm victim: what a bulk copy next to a running service starts from
+    Residency unused;
+    walk_tree(source, evict_file, &unused);
+    walk_tree(victim, warm_file, &unused);
+
+    Residency victim_before = measure(victim);
+    Residency source_before = measure(source);
+    Residency destination_before = measure(destination);
+    long long cached_before = cached_kb();
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking");
+        return 1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execvp(argv[4], argv + 4);
+        perror("Error running command");
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double elapsed = now_seconds() - start;
+
+    Residency victim_after = measure(victim);
+    Residency source_after = measure(source);
+    Residency destination_after = measure(destination);
+    long long cached_after = cached_kb();
+
+    printf("Command exited with %d after %.2f seconds\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1, elapsed);
+    printf("%-12s %20s    %20s\n", "", "before", "after");
+    print_residency("victim", victim, victim_before, victim_after);
+    print_residency("source", source, source_before, source_after);
+    print_residency("destination", destination, destination_before, destination_after);
+    printf("Page cache:  %.1f MB -> %.1f MB (%+.1f MB)\n", cached_before / 1024.0, cached_after / 1024.0,
+           (cached_after - cached_before) / 1024.0);
+    return 0;
+}
+
+// Workload generation. Trees depend only on the shape, seed and scale, so the same
+// command line reproduces the same tree byte for byte.
+uint64_t random_state;
+
+uint64_t next_random() {
+    // splitmix64
+    uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [low, high)
+uint64_t random_between(uint64_t low, uint64_t high) {
+    return high > low ? low + next_random() % (high - low) : low;
+}
+
+int make_directory(const char* path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating directory %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Write size bytes of pseudo-random (incompressible) data at offset
+int write_random(int fd, off_t offset, off_t size) {
+    static uint64_t block[1 << 13];
+    while (size > 0) {
+        size_t length = size < (off_t)sizeof(block) ? (size_t)size : sizeof(block);
+        for (size_t i = 0; i < (length + 7) / 8; i++) {
+            block[i] = next_random();
+        }
+        if (pwrite(fd, block, length, offset) != (ssize_t)length) {
+            return -1;
+        }
+        offset += length;
+        size -= length;
+    }
+    return 0;
+}
+
+int create_file(const char* path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write_random(fd, 0, size) == -1) {
+        fprintf(stderr, "Error writing file %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// A file of the given apparent size holding 1 MB data extents at random places,
+// about one sixteenth of it in all
+int create_sparse_file(const char* path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        fprintf(stderr, "Error writing file %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    off_t extents = size >> 20;
+    for (off_t extent = 0; extent < extents; extent++) {
+        if (random_between(0, 16) == 0 && write_random(fd, extent << 20, 1 << 20) == -1) {
+            fprintf(stderr, "Error writing file %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Many tiny files (0-4 KB) spread over 200 directories
+int generate_tiny(const char* root, double scale) {
+    int files = (int)(20000 * scale);
+    char path[PATH_MAX];
+    for (int i = 0; i < files; i++) {
+        if (i % 100 == 0) {
+            snprintf(path, sizeof(path), "%s/d%03d", root, i / 100);
+            if (make_directory(path) == -1) {
+                return -1;
+            }
+        }
+        snprintf(path, sizeof(path), "%s/d%03d/f%05d", root, i / 100, i);
+        if (create_file(path, random_between(0, 4096)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A spread of sizes: mostly small files, some medium, a few of several MB
+int generate_mixed(const char* root, double scale) {
+    int files = (int)(1000 * scale);
+    char path[PATH_MAX];
+    for (int i = 0; i < files; i++) {
+        uint64_t pick = random_between(0, 100);
+        off_t size = pick < 70 ? random_between(1 << 10, 64 << 10)
+                   : pick < 95 ? random_between(64 << 10, 1 << 20)
+                   : random_between(1 << 20, 8 << 20);
+        snprintf(path, sizeof(path), "%s/f%05d", root, i);
+        if (create_file(path, size) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// A few huge files
+int generate_huge(const char* root, double scale) {
+    char path[PATH_MAX];
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/huge%d", root, i);
+        if (create_file(path, (off_t)((128 << 20) * scale)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Large sparse files, mostly holes
+int generate_sparse(const char* root, double scale) {
+    char path[PATH_MAX];
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "%s/sparse%d", root, i);
+        if (create_sparse_file(path, (off_t)((256 << 20) * scale)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Deep trees: chains of 32 nested directories with two small files at every level
+int generate_deep(const char* root, double scale) {
+    int chains = (int)(32 * scale);
+    for (int chain = 0; chain < chains; chain++) {
+        char path[PATH_MAX];
+        int length = snprintf(path, sizeof(path), "%s/c%03d", root, chain);
+        for (int depth = 0; depth < 32; depth++) {
+            if (make_directory(path) == -1) {
+                return -1;
+            }
+            for (int i = 0; i < 2; i++) {
+                char file[PATH_MAX];
+                if (snprintf(file, sizeof(file), "%s/f%d", path, i) >= (int)sizeof(file) ||
+                    create_file(file, random_between(1 << 10, 16 << 10)) == -1) {
+                    return -1;
+                }
+            }
+            length += snprintf(path + length, sizeof(path) - length, "/d%02d", depth);
+        }
+    }
+    return 0;
+}
+
+// generate SHAPE DIRECTORY [SEED [SCALE]]
+int generate_command(int argc, char* argv[]) {
+    static const struct {
+        const char* name;
+        int (*generate)(const char*, double);
+    } shapes[] = {
+        { "tiny", generate_tiny },
+        { "mixed", generate_mixed },
+        { "huge", generate_huge },
+        { "sparse", generate_sparse },
+        { "deep", generate_deep }
+    };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: pCpBench generate tiny|mixed|huge|sparse|deep DIRECTORY [SEED [SCALE]]\n");
+        return 1;
+    }
+    random_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    double scale = argc > 3 ? atof(argv[3]) : 1.0;
+    if (scale <= 0) {
+        fprintf(stderr, "Invalid scale: %s\n", argv[3]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        if (strcmp(argv[0], shapes[i].name) == 0) {
+            if (make_directory(argv[1]) == -1 || shapes[i].generate(argv[1], scale) == -1) {
+                return 1;
+            }
+            Residency total = { 0, 0, 0, 0 };
+            walk_tree(argv[1], count_file, &total);
+            printf("Generated %s: %llu files, %.1f MB\n", argv[1], total.files, total.bytes / 1048576.0);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown shape: %s\n", argv[0]);
+    return 1;
+}
+
+int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st; // Unused parameter
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Split a comma separated list in place; returns the number of items
+int split_list(char* text, char* items[]) {
+    int count = 0;
+    for (char* item = strtok(text, ","); item != NULL && count < MAX_GRID; item = strtok(NULL, ",")) {
+        items[count++] = item;
+    }
+    return count;
+}
+
+// Copy source to a fresh destination with one setting of the grid; returns the exit status
+int run_copy(char* command[], struct rusage* usage, double* elapsed) {
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execvp(command[0], command);
+        perror("Error running pCp");
+        _exit(127);
+    }
+    int status;
+    wait4(pid, &status, 0, usage);
+    *elapsed = now_seconds() - start;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// sweep --source=DIR [grid options] [-- extra pCp arguments]
+int sweep_command(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        { "pcp", required_argument, NULL, 'p' },
+        { "source", required_argument, NULL, 's' },
+        { "destination", required_argument, NULL, 'd' },
+        { "consumers", required_argument, NULL, 'c' },
+        { "queues", required_argument, NULL, 'q' },
+        { "engines", required_argument, NULL, 'e' },
+        { "repeat", required_argument, NULL, 'r' },
+        { "csv", required_argument, NULL, 'o' },
+        { "label", required_argument, NULL, 'l' },
+        { "cold", no_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char* pcp = "./pCp";
+    const char* source = NULL;
+    const char* destination = NULL;
+    const char* csv = NULL;
+    const char* label = NULL;
+    char consumer_list[256] = "1,2,4,8";
+    char queue_list[256] = "10,64";
+    char engine_list[256] = "threads,uring";
+    int repeat = 1;
+    int cold = 0;
+
+    int opt;
+    optind = 0;
+    while ((opt = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': pcp = optarg; break;
+            case 's': source = optarg; break;
+            case 'd': destination = optarg; break;
+            case 'c': snprintf(consumer_list, sizeof(consumer_list), "%s", optarg); break;
+            case 'q': snprintf(queue_list, sizeof(queue_list), "%s", optarg); break;
+            case 'e': snprintf(engine_list, sizeof(engine_list), "%s", optarg); break;
+            case 'r': repeat = atoi(optarg); break;
+            case 'o': csv = optarg; break;
+            case 'l': label = optarg; break;
+            case 'C': cold = 1; break;
+            default: return 1;
+        }
+    }
+    if (source == NULL || repeat < 1) {
+        fprintf(stderr, "Usage: pCpBench sweep --source=DIR [--destination=PARENT] [--pcp=PATH] [--consumers=LIST]\n"
+                        "       [--queues=LIST] [--engines=LIST] [--repeat=N] [--csv=FILE] [--label=TEXT] [--cold]\n"
+                        "       [-- extra pCp arguments]\n");
+        return 1;
+    }
+    // Copies go to a scratch directory made inside --destination (by default next to the
+    // source), and only that directory is ever removed
+    char work[PATH_MAX];
+    char copy[PATH_MAX + 8];
+    if (destination == NULL) {
+        const char* slash = strrchr(source, '/');
+        snprintf(work, sizeof(work), "%.*s/pcp-sweep.XXXXXX", slash != NULL ? (int)(slash - source) : 1,
+                 slash != NULL ? source : ".");
+    } else {
+        snprintf(work, sizeof(work), "%s/pcp-sweep.XXXXXX", destination);
+    }
+    if (mkdtemp(work) == NULL) {
+        fprintf(stderr, "Error creating scratch directory %s: %s\n", work, strerror(errno));
+        return 1;
+    }
+    snprintf(copy, sizeof(copy), "%s/copy", work);
+    if (label == NULL) {
+        label = strrchr(source, '/') ? strrchr(source, '/') + 1 : source;
+    }
+
+    char* consumers[MAX_GRID];
+    char* queues[MAX_GRID];
+    char* engines[MAX_GRID];
+    int consumer_count = split_list(consumer_list, consumers);
+    int queue_count = split_list(queue_list, queues);
+    int engine_count = split_list(engine_list, engines);
+    char** extra = argv + optind;
+    int extra_count = argc - optind;
+
+    // Append, so sweeps over several trees collect in one file
+    FILE* out = stdout;
+    if (csv != NULL && (out = fopen(csv, "a")) == NULL) {
+        fprintf(stderr, "Error opening %s: %s\n", csv, strerror(errno));
+        rmdir(work);
+        return 1;
+    }
+    if (ftell(out) <= 0) {
+        fprintf(out, "label,engine,consumers,queue,run,exit_status,seconds,files,bytes,"
+                     "mb_per_second,files_per_second,user_seconds,system_seconds,cpu_seconds\n");
+    }
+
+    Residency total = { 0, 0, 0, 0 };
+    walk_tree(source, count_file, &total);
+
+    for (int e = 0; e < engine_count; e++) {
+        for (int c = 0; c < consumer_count; c++) {
+            for (int q = 0; q < queue_count; q++) {
+                for (int run = 0; run < repeat; run++) {
+                    Residency unused;
+                    nftw(copy, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+                    if (cold) {
+                        walk_tree(source, evict_file, &unused);
+                    }
+
+                    char engine[64];
+                    snprintf(engine, sizeof(engine), "--engine=%s", engines[e]);
+                    char* command[extra_count + 8];
+                    int n = 0;
+                    command[n++] = (char*)pcp;
+                    command[n++] = engine;
+                    for (int i = 0; i < extra_count; i++) {
+                        command[n++] = extra[i];
+                    }
+                    command[n++] = queues[q];
+                    command[n++] = consumers[c];
+                    command[n++] = (char*)source;
+                    command[n++] = copy;
+                    command[n] = NULL;
+
+                    struct rusage usage;
+                    double seconds;
+                    int status = run_copy(command, &usage, &seconds);
+                    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+                    double system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+                    // A failed run did not copy the source totals; leave its throughput empty
+                    char throughput[64] = ",";
+                    if (status == 0 && seconds > 0) {
+                        snprintf(throughput, sizeof(throughput), "%.3f,%.3f", total.bytes / 1048576.0 / seconds,
+                                 total.files / seconds);
+                    }
+                    fprintf(out, "%s,%s,%s,%s,%d,%d,%.6f,%llu,%llu,%s,%.6f,%.6f,%.6f\n",
+                            label, engines[e], consumers[c], queues[q], run + 1, status, seconds,
+                            total.files, total.bytes, throughput, user, system, user + system);
+                    fflush(out);
+                    fprintf(stderr, "%s %s consumers=%s queue=%s run %d: %.2f s%s\n",
+                            label, engines[e], consumers[c], queues[q], run + 1, seconds,
+                            status == 0 ? "" : " (failed)");
+                }
+            }
+        }
+    }
+
+    nftw(work, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s <command> [arguments]\n", program);
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  residency PATH...                              page cache residency of each tree\n");
+    fprintf(stderr, "  cache VICTIM SOURCE DESTINATION -- COMMAND...  residency before and after running COMMAND\n");
+    fprintf(stderr, "  generate SHAPE DIRECTORY [SEED [SCALE]]        write a reproducible tree: tiny, mixed, huge,\n");
+    fprintf(stderr, "                                                 sparse or deep\n");
+    fprintf(stderr, "  sweep --source=DIR [options] [-- pCp args]     run pCp over a grid of consumers, queue sizes\n");
+    fprintf(stderr, "                                                 and engines, writing CSV\n");
+}
+
+int main(int argc, char* argv[]) {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "residency") == 0) {
+        return residency_command(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "cache") == 0) {
+        return cache_command(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "generate") == 0) {
+        return generate_command(argc - 2, argv + 2);
+    }
+    if (strcmp(argv[1], "sweep") == 0) {
+        return sweep_command(argc - 1, argv + 1);
+    }
+    usage(argv[0]);
+    return 1;
+}